@@ -0,0 +1,70 @@
+#!/bin/sh
+# check.sh - round-trip tests for the QFS tools, run by "make check".
+#
+# For each mkfs_qfs variant a small image is formatted, files of several
+# sizes are written to it (from a path and from standard input), read back
+# and compared, scrubbed when it has checksums, replicated with
+# qfs_snapshot / qfs_sync, and finally deleted again, after which the image
+# must have all its blocks and directory entries free once more.
+#
+# The tools are run directly on the images; a QFSD_SOCKET in the
+# environment is ignored so that no daemon is involved.
+
+set -e
+unset QFSD_SOCKET QFS_TRACE
+
+B=$(pwd)
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+opts=
+fail() {
+    echo "FAIL [mkfs_qfs $opts]: $*" >&2
+    exit 1
+}
+
+# Inline on packed images, a packed tail, and a file of many blocks
+head -c 40 /dev/urandom > "$T/tiny"
+head -c 1000 /dev/urandom > "$T/small"
+head -c 200000 /dev/urandom > "$T/big"
+cp "$T/big" "$T/twin"
+cp "$B/pic1.jpg" "$T/pic1.jpg"
+files="tiny small big twin pic1.jpg"
+
+for opts in "" "-d" "-c" "-s" "-p" "-b 4096" "-d -c -s -p"; do
+    img="$T/disk.img"
+    rm -f "$img" "$img".* "$T/replica.img" "$T/replica.img".* "$T/delta"
+    dd if=/dev/zero of="$img" bs=1M count=4 2>/dev/null
+    "$B/mkfs_qfs" $opts "$img" Check > /dev/null || fail "mkfs_qfs"
+    empty=$("$B/list_information" "$img" | grep -i "free")
+
+    for f in $files; do
+        "$B/write_file" "$img" "$T/$f" > /dev/null || fail "write_file $f"
+    done
+    "$B/write_file" "$img" - piped < "$T/small" > /dev/null || fail "write_file -"
+
+    for f in $files; do
+        "$B/read_file" "$img" "$f" "$T/out" > /dev/null || fail "read_file $f"
+        cmp -s "$T/out" "$T/$f" || fail "$f differs after a round trip"
+    done
+    "$B/read_file" "$img" piped - | cmp -s - "$T/small" || fail "piped differs"
+
+    case " $opts " in
+    *" -c "*)
+        "$B/qfs_scrub" "$img" > /dev/null || fail "qfs_scrub" ;;
+    esac
+
+    "$B/qfs_snapshot" "$img" "$T/delta" 2> /dev/null || fail "qfs_snapshot"
+    "$B/qfs_sync" "$T/replica.img" "$T/delta" > /dev/null || fail "qfs_sync"
+    cmp -s "$img" "$T/replica.img" || fail "replica differs from the image"
+
+    for f in $files piped; do
+        "$B/delete_file" "$img" "$f" > /dev/null || fail "delete_file $f"
+    done
+    [ "$("$B/list_information" "$img" | grep -i "free")" = "$empty" ] ||
+        fail "blocks or entries still in use after deleting every file"
+
+    echo "ok   mkfs_qfs $opts"
+done
+
+echo "All checks passed."
@@ -9,24 +9,78 @@
  * Removes a file from a QFS disk image by clearing its directory entry
  * and marking all blocks used by the file as free. The superblock is
  * updated to reflect freed blocks and directory entries.
+ *
+ * A block's busy byte is its reference count: blocks shared with other
+ * files by deduplication (see write_file.c) are only released once the
+ * last file referencing them is deleted.
+ *
+ * On sparse images (mkfs_qfs -s) released blocks are not written at all:
+ * they are collected in a compact free map, coalesced into extents and
+ * punched out of the image file, which reclaims the host disk space. The
+ * holes read back as zeros, i.e. as free blocks.
+ *
+ * On packed images (mkfs_qfs -p, see qfs_pack.h) an inline file's
+ * continuation records are cleared with its entry, and a packed tail is
+ * removed from its shared tail block, which is only freed with its last
+ * slice.
+ *
+ * When QFSD_SOCKET is set and the qfsd daemon serves the image, the file is
+ * removed by the daemon instead (see qfsd_proto.h). With QFS_TRACE set the
+ * delete is recorded in an operation trace (see qfs_trace.h).
+ *
+ * On images tracked for snapshots (see qfs_gen.h) the file's blocks are
+ * stamped with a new generation before they are released.
  */
 
+#define _GNU_SOURCE               // fallocate() (see qfs_io.h)
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include "qfs.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+#include "qfs_pack.h"
+#include "qfsd_proto.h"
+#include "qfs_trace.h"
 
-int main(int argc, char *argv[]) {
+static int run(int argc, char *argv[]) {
     if (argc != 3) {
         fprintf(stderr, "Usage: %s <disk image file> <file to remove>\n", argv[0]);
         return 1;
     }
 
+    // Let the daemon do it when it serves this image
+    void *reply;
+    uint32_t reply_len;
+    int status = qfsd_call(argv[1], QFSD_OP_DELETE, argv[2], NULL, 0, &reply, &reply_len);
+    free(reply);
+    if (status == QFSD_FAILED) {
+        qfsd_perror(argv[1]);
+        return 8;
+    }
+    if (status >= 0 && status != QFSD_NOIMAGE)
+        qfs_trace_skip();
+    if (status == QFSD_OK) {
+        printf("File \"%s\" removed successfully.\n", argv[2]);
+        return 0;
+    } else if (status == QFSD_NOENT) {
+        fprintf(stderr, "File \"%s\" not found.\n", argv[2]);
+        return 6;
+    } else if (status >= 0 && status != QFSD_NOIMAGE) {
+        fprintf(stderr, "Error removing \"%s\".\n", argv[2]);
+        return 8;
+    }
+
     FILE *fp = fopen(argv[1], "rb+");
     if (!fp) {
         perror("fopen");
         return 2;
     }
+    if (qfsd_lock_image(fileno(fp), argv[1], 1) != 0) {
+        fclose(fp);
+        return 2;
+    }
 
 #ifdef DEBUG
     printf("Opened disk image: %s\n", argv[1]);
@@ -60,9 +114,10 @@ int main(int argc, char *argv[]) {
             return 5;
         }
 
-        if (entry.filename[0] != '\0' &&
+        if (entry.filename[0] != '\0' && entry.filename[0] != QFS_DIRENT_CONT &&
             strcmp(entry.filename, argv[2]) == 0) {
             dir_index = i;
+            qfs_trace_size(entry.file_size);
             break;
         }
     }
@@ -79,47 +134,235 @@ int main(int argc, char *argv[]) {
         sizeof(superblock_t) +
         sizeof(direntry_t) * sb.total_direntries;
 
-    // Traverse the block chain and mark blocks as free
-    uint16_t block = entry.starting_block;
+    // Traverse the block chain with read-ahead (see qfs_io.h), recording
+    // each block and what its busy byte becomes once this file's
+    // reference is dropped
+    uint32_t data_per_block = qfs_data_per_block(&sb);
+    uint32_t expected = (entry.file_size + data_per_block - 1) / data_per_block;
+    if (expected == 0)
+        expected = 1;
+
+    // A packed file's tail block is read in full so that its slice can be
+    // removed (see qfs_pack.h)
+    int tail_packed = (entry.permissions & QFS_PERM_TAIL) != 0;
+    uint8_t *tail_buf = tail_packed ? malloc(sb.bytes_per_block) : NULL;
+
+    uint16_t *blocks = malloc(sizeof(uint16_t) * sb.total_blocks);
+    uint8_t *busy = malloc(sb.total_blocks ? sb.total_blocks : 1);
+    if (!blocks || !busy || (tail_packed && !tail_buf)) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(tail_buf);
+        free(blocks);
+        free(busy);
+        fclose(fp);
+        return 7;
+    }
+
+    qfs_io_t io;
+    qfs_io_init(&io, fileno(fp));
+
+    qfs_chain_t chain;
+    if (qfs_chain_open(&chain, &io, &sb, entry.starting_block, expected) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        qfs_io_close(&io);
+        free(tail_buf);
+        free(blocks);
+        free(busy);
+        fclose(fp);
+        return 7;
+    }
+
+    uint32_t nblocks = 0;
+    uint32_t steps = 0;
     uint32_t freed_blocks = 0;
+    const uint8_t *buffer;
+    uint16_t block;
+
+    int tail_index = -1;
+
+    // Every block the chain visits counts as a step, including the free
+    // ones skipped below, so a chain that cycles through them still ends
+    int chain_loops = 0;
+    while ((buffer = qfs_chain_next(&chain, &block)) != NULL) {
+        if (++steps > sb.total_blocks) {
+            chain_loops = 1;
+            break;
+        }
+        // The tail block ends a packed file's chain; dropping its slice
+        // leaves the other files' slices, and their count, in place
+        uint32_t bpb = sb.bytes_per_block;
+        if (tail_packed && buffer[bpb - 2] == 0xFF && buffer[bpb - 1] == 0xFF) {
+            memcpy(tail_buf, buffer, bpb);
+            qfs_tail_rebuild(&sb, tail_buf, dir_index, 0, NULL, 0);
+            if (tail_buf[0] == 0x00)
+                freed_blocks++;
+            tail_index = nblocks;
+            blocks[nblocks] = block;
+            busy[nblocks] = tail_buf[0];
+            nblocks++;
+            continue;
+        }
 
-    while (block != 0xFFFF) {
+        // A block on a live chain that is already marked free means the
+        // image is damaged; leave it alone rather than credit it twice
+        if (buffer[0] == 0x00) {
+            fprintf(stderr, "Block %u of \"%s\" is already marked free; skipping it.\n",
+                    block, argv[2]);
+            continue;
+        }
 
-        long block_offset = data_start +
-                            (long)block * sb.bytes_per_block;
+        // Drop this file's reference; the block is free once none remain
+        uint8_t refs = buffer[0] - 1;
+        if (refs == 0x00)
+            freed_blocks++;
 
-        fseek(fp, block_offset, SEEK_SET);
+        blocks[nblocks] = block;
+        busy[nblocks] = refs;
+        nblocks++;
+    }
+    int chain_error = chain.error;
+    qfs_chain_close(&chain);
+
+    if (chain_error || chain_loops) {
+        fprintf(stderr, chain_loops ? "Block chain of \"%s\" loops; directory left unchanged.\n"
+                                    : "Error reading block chain of \"%s\".\n", argv[2]);
+        qfs_io_close(&io);
+        free(tail_buf);
+        free(blocks);
+        free(busy);
+        fclose(fp);
+        return 8;
+    }
+
+    // Every block of the chain changes (see qfs_gen.h)
+    qfs_gen_mark_image(argv[1], blocks, nblocks);
+
+    // On sparse images mark released blocks in a bitmap and punch each
+    // run of them out of the file. Anything that cannot be punched falls
+    // back to having its busy byte cleared.
+    uint8_t *freemap = calloc(((uint32_t)sb.total_blocks + 7) / 8, 1);
+    if (freemap && (sb.features & QFS_FEAT_SPARSE)) {
+        for (uint32_t i = 0; i < nblocks; i++) {
+            if (busy[i] == 0x00)
+                freemap[blocks[i] / 8] |= 1 << (blocks[i] % 8);
+        }
+
+        fflush(fp);
+        for (uint32_t b = 0; b < sb.total_blocks; ) {
+            if (!(freemap[b / 8] & (1 << (b % 8)))) {
+                b++;
+                continue;
+            }
+            uint32_t e = b;
+            while (e < sb.total_blocks && (freemap[e / 8] & (1 << (e % 8))))
+                e++;
+
+            if (qfs_io_punch(fileno(fp), data_start + (off_t)b * sb.bytes_per_block,
+                             (off_t)(e - b) * sb.bytes_per_block) != 0) {
+                for (uint32_t k = b; k < e; k++)
+                    freemap[k / 8] &= ~(1 << (k % 8));
+            }
+            b = e;
+        }
+    }
 
-        uint8_t buffer[sb.bytes_per_block];
-        fread(buffer, sb.bytes_per_block, 1, fp);
+    // Write the new busy bytes through the async queue. The queue is
+    // topped up whenever half of it has completed, so writes stay in
+    // flight across refills instead of draining between batches. Any
+    // failed write leaves the directory entry and the superblock
+    // untouched, so the file stays where it was.
+    int write_error = 0;
+    uint32_t i = 0, pending = 0;
+    while (!write_error && (i < nblocks || pending > 0)) {
+        uint32_t added = 0;
+        while (i < nblocks) {
+            if (freemap && (freemap[blocks[i] / 8] & (1 << (blocks[i] % 8)))) {
+                i++;          // already a hole
+                continue;
+            }
+            long offset = data_start + (long)blocks[i] * sb.bytes_per_block;
+            int queued = ((int)i == tail_index && busy[i] != 0x00)
+                       ? qfs_io_queue(&io, 1, tail_buf, sb.bytes_per_block, offset, i)
+                       : qfs_io_queue(&io, 1, &busy[i], 1, offset, i);
+            if (queued != 0)
+                break;        // queue full
+            i++;
+            added++;
+        }
+        if (added > 0) {
+            if (qfs_io_submit(&io) != 0) {
+                write_error = 1;
+                break;
+            }
+            pending += added;
+        }
+        if (pending == 0) {
+            // Nothing in flight, yet the next write could not be queued
+            if (i < nblocks) {
+                fprintf(stderr, "Error updating block %u\n", blocks[i]);
+                write_error = 1;
+            }
+            break;
+        }
 
-        // Get next block number from last two bytes
-        uint16_t next =
-            buffer[sb.bytes_per_block - 2] |
-            (buffer[sb.bytes_per_block - 1] << 8);
+        uint32_t low = i < nblocks ? QFS_IO_DEPTH / 2 : 0;
+        while (pending > low) {
+            uint64_t tag;
+            ssize_t res;
+            if (qfs_io_wait(&io, &tag, &res) != 0) {
+                write_error = 1;
+                pending = 0;
+                break;
+            }
+            pending--;
+            size_t len = ((int)tag == tail_index && busy[tag] != 0x00) ? sb.bytes_per_block : 1;
+            if (res != (ssize_t)len) {
+                fprintf(stderr, "Error updating block %u\n", blocks[tag]);
+                write_error = 1;
+            }
+        }
+    }
+    // The buffers of writes still in flight after an error are freed below
+    while (pending > 0) {
+        uint64_t tag;
+        ssize_t res;
+        if (qfs_io_wait(&io, &tag, &res) != 0)
+            break;
+        pending--;
+    }
 
-        // Mark block as free
-        buffer[0] = 0x00;
+    // A tail block that has lost its last slice no longer takes new tails
+    if (tail_index >= 0 && busy[tail_index] == 0x00 && blocks[tail_index] == sb.tail_block)
+        sb.tail_block = 0xFFFF;
 
-        fseek(fp, block_offset, SEEK_SET);
-        fwrite(buffer, sb.bytes_per_block, 1, fp);
+    free(freemap);
+    qfs_io_close(&io);
+    free(tail_buf);
+    free(blocks);
+    free(busy);
 
-        freed_blocks++;
-        block = next;
+    if (write_error) {
+        fprintf(stderr, "Error removing \"%s\"; directory left unchanged.\n", argv[2]);
+        fclose(fp);
+        return 8;
     }
 
-    // Clear the directory entry
+    // Clear the directory entry, with an inline file's continuation records
+    uint32_t entries = 1;
+    if (entry.permissions & QFS_PERM_INLINE)
+        entries += qfs_inline_slots(entry.file_size);
     memset(&entry, 0, sizeof(entry));
 
     fseek(fp,
           sizeof(superblock_t) +
           dir_index * sizeof(direntry_t),
           SEEK_SET);
-    fwrite(&entry, sizeof(direntry_t), 1, fp);
+    for (uint32_t k = 0; k < entries; k++)
+        fwrite(&entry, sizeof(direntry_t), 1, fp);
 
     // Update superblock counts
     sb.available_blocks += freed_blocks;
-    sb.available_direntries++;
+    sb.available_direntries += entries;
 
     fseek(fp, 0, SEEK_SET);
     fwrite(&sb, sizeof(superblock_t), 1, fp);
@@ -129,3 +372,10 @@ int main(int argc, char *argv[]) {
     printf("File \"%s\" removed successfully.\n", argv[2]);
     return 0;
 }
+
+int main(int argc, char *argv[]) {
+    qfs_trace_begin(QFS_TRACE_DELETE, argc >= 3 ? argv[2] : "");
+    int rc = run(argc, argv);
+    qfs_trace_end(rc);
+    return rc;
+}
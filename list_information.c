@@ -8,23 +8,78 @@ Usage: list_information <filesystem_image>
 This program reads in the QFS disk image and list information about the disk image
 from the superblock and its directory contents
 
+When QFSD_SOCKET is set and the qfsd daemon serves the image, the listing
+comes from the daemon instead (see qfsd_proto.h), and with QFS_TRACE set the
+listing is recorded in an operation trace (see qfs_trace.h)
+
 */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "qfs.h"
-
-int main(int argc, char *argv[]) {
+#include "qfs_pack.h"
+#include "qfsd_proto.h"
+#include "qfs_trace.h"
+
+//prints the superblock summary the same way for both sources
+static void printSuperblock(const superblock_t *sblock){
+    printf("Block size: %u\n", sblock->bytes_per_block);
+    printf("Total number of blocks: %u\n", sblock->total_blocks);
+    printf("Number of free blocks: %u\n", sblock->available_blocks);
+    printf("Total number of directory entries: %u\n", sblock->total_direntries);
+    printf("Number of free directory entries: %u\n", sblock->available_direntries);
+}
+
+static void printEntry(const direntry_t *directoryEntry){
+    char name[24];
+    memcpy(name, directoryEntry->filename, 23);
+    name[23] = '\0';
+
+    printf("%s\t%u\t%u\n", name, directoryEntry->file_size, directoryEntry->starting_block);
+}
+
+static int run(int argc, char *argv[]) {
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <disk image file>\n", argv[0]);
         return 1;
     }
+
+    //ask the daemon first; the reply is the superblock followed by the files
+    void *reply;
+    uint32_t replyLen;
+    int status = qfsd_call(argv[1], QFSD_OP_LIST, "", NULL, 0, &reply, &replyLen);
+    if (status == QFSD_OK && replyLen >= sizeof(superblock_t)){
+        printSuperblock(reply);
+        const direntry_t *entries = (const direntry_t *)((uint8_t *)reply + sizeof(superblock_t));
+        for (uint32_t i = 0; i < (replyLen - sizeof(superblock_t)) / sizeof(direntry_t); i++){
+            printEntry(&entries[i]);
+        }
+        free(reply);
+        qfs_trace_skip();
+        return 0;
+    }
+    free(reply);
+    //only read the image itself when there is no daemon serving it
+    if (status == QFSD_FAILED){
+        qfsd_perror(argv[1]);
+        return 2;
+    }
+    if (status != QFSD_NODAEMON && status != QFSD_NOIMAGE){
+        fprintf(stderr, "Error listing %s through qfsd.\n", argv[1]);
+        qfs_trace_skip();
+        return 2;
+    }
     FILE *fp = fopen(argv[1], "rb");
     if (!fp) {
         perror("fopen");
         return 2;
     }
+    if (qfsd_lock_image(fileno(fp), argv[1], 0) != 0) {
+        fclose(fp);
+        return 2;
+    }
 
     superblock_t sblock;
     fseek(fp, 0, SEEK_SET);
@@ -39,11 +94,7 @@ int main(int argc, char *argv[]) {
     }
 
     //printing out the information
-    printf("Block size: %u\n", sblock.bytes_per_block);
-    printf("Total number of blocks: %u\n", sblock.total_blocks);
-    printf("Number of free blocks: %u\n", sblock.available_blocks);
-    printf("Total number of directory entries: %u\n", sblock.total_direntries);
-    printf("Number of free directory entries: %u\n", sblock.available_direntries);
+    printSuperblock(&sblock);
 
     //directory entries start at offset 32 when the total amount of entries is 255
     fseek(fp, 32, SEEK_SET);
@@ -53,12 +104,9 @@ int main(int argc, char *argv[]) {
         fread(&directoryEntry, sizeof(direntry_t), 1, fp);
 
         //if the entry is in use if file isn't empty
-        if(directoryEntry.filename[0] != '\0'){
-            char name[24];
-            memcpy(name, directoryEntry.filename, 23);
-            name[23] = '\0';
-
-            printf("%s\t%u\t%u\n", name, directoryEntry.file_size, directoryEntry.starting_block);
+        //(continuation records of inline files are part of the entry before them)
+        if(directoryEntry.filename[0] != '\0' && directoryEntry.filename[0] != QFS_DIRENT_CONT){
+            printEntry(&directoryEntry);
         }
     }
 
@@ -71,4 +119,11 @@ int main(int argc, char *argv[]) {
 
     fclose(fp);
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    qfs_trace_begin(QFS_TRACE_LIST, "");
+    int rc = run(argc, argv);
+    qfs_trace_end(rc);
+    return rc;
+}
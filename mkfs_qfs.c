@@ -6,7 +6,16 @@
 **
 ** Program to make a filesystem on a blank file using the qfs parameters
 **
-** Usage: mkfs_qfs <disk image file> [<label>]
+** Usage: mkfs_qfs [-d] [-c] [-s] [-p] [-b <bytes>] <disk image file> [<label>]
+**
+**   -d  enable block-level deduplication (see write_file.c)
+**   -c  store a CRC32C in every block (see qfs_crc.h)
+**   -s  sparse image: free blocks are holes in the image file, so the
+**       host file only occupies space for live data (see delete_file.c)
+**   -p  store small files inline in the directory and pack the tails of
+**       larger files into shared blocks (see qfs_pack.h)
+**   -b  block size in bytes, a power of two from 512 (the default) to
+**       32768; 512 and 4096 have specialized kernels (see qfs_kernels.h)
 **
 ** To create a blank file of a specific size, you can use the following command:
 **   dd if=/dev/zero of=<disk image file> bs=1M count=<size in MB>
@@ -21,15 +30,51 @@
 **
 */
 
+#define _GNU_SOURCE               // fallocate() (see qfs_io.h)
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "qfs.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
 
 int main(int argc, char *argv[]) {
 
+    // Leading options select optional features; the remaining arguments
+    // are the image and label as before.
+    uint8_t features = 0;
+    long block_size = 512;
+    const char *prog = argv[0];
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-d") == 0) {
+            features |= QFS_FEAT_DEDUP;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            features |= QFS_FEAT_CRC;
+        } else if (strcmp(argv[1], "-s") == 0) {
+            features |= QFS_FEAT_SPARSE;
+        } else if (strcmp(argv[1], "-p") == 0) {
+            features |= QFS_FEAT_PACK;
+        } else if (strcmp(argv[1], "-b") == 0 && argc > 2) {
+            block_size = strtol(argv[2], NULL, 10);
+            if (block_size < 512 || block_size > 32768 || (block_size & (block_size - 1))) {
+                fprintf(stderr, "Block size must be a power of two from 512 to 32768.\n");
+                return 1;
+            }
+            argv++;
+            argc--;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            argc = 0;
+            break;
+        }
+        argv++;
+        argc--;
+    }
+
     if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <disk image file> [<label>]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-d] [-c] [-s] [-p] [-b <bytes>] <disk image file> [<label>]\n", prog);
         return 1;
     }
 
@@ -60,6 +105,8 @@ int main(int argc, char *argv[]) {
     memset(&sb, 0, sizeof(superblock_t));
     // Set QFS magic number
     sb.fs_type = 0x51; // QFS type
+    sb.features = features;
+    sb.tail_block = 0xFFFF; // no tail block yet
 
     // Set label if provided
     if (argc == 3) {
@@ -99,7 +146,7 @@ int main(int argc, char *argv[]) {
 
     // Calculate block size and counts (TODO: adjust these calculations as needed)
     int total_data_available = (file_size - sizeof(superblock_t) - (sizeof(direntry_t) * 255));
-    sb.bytes_per_block = 512;
+    sb.bytes_per_block = (uint16_t)block_size;
 
 #ifdef DEBUG
     fprintf(stderr, "Total data available: %d\n", total_data_available);
@@ -143,11 +190,22 @@ int main(int argc, char *argv[]) {
     fprintf(stderr,"Clearing data blocks...\n");
 #endif
 
+    // Sparse images: punch the whole data region out of the host file.
+    // Holes read back as zeros, so every block is free.
+    int cleared = 0;
+    if (sb.features & QFS_FEAT_SPARSE) {
+        fflush(fp);
+        cleared = qfs_io_punch(fileno(fp), sizeof(superblock_t) + sizeof(dir_zeros),
+                               (off_t)sb.total_blocks * sb.bytes_per_block) == 0;
+        if (!cleared)
+            fprintf(stderr, "Warning: cannot punch holes in %s, writing blocks instead.\n", argv[1]);
+    }
+
     // Block initialization: mark all data blocks as free (byte 1 of each block = 0)
     uint8_t data = 0x00;
     // Move to first data block
     fseek(fp, sizeof(superblock_t) + sizeof(dir_zeros), SEEK_SET);
-    for (int i = 0; i < sb.total_blocks; i++) {
+    for (int i = 0; i < sb.total_blocks && !cleared; i++) {
         // Set block busy byte to zero
         fwrite(&data, 1, 1, fp);
         // Move to next block
@@ -158,5 +216,16 @@ int main(int argc, char *argv[]) {
     fflush(fp);
     fclose(fp);
 
+    // A dedup hash index left over from a previous filesystem on this image
+    // would describe blocks that no longer exist, so drop it.
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.qdx", argv[1]);
+    unlink(index_path);
+
+    // Likewise a generation map: every block has changed, so snapshots of
+    // this image start over from a full delta (see qfs_gen.h).
+    qfs_gen_path(index_path, sizeof(index_path), argv[1]);
+    unlink(index_path);
+
     return 0;
 }
\ No newline at end of file
@@ -6,9 +6,22 @@
 **
 */
 
+#ifndef QFS_H
+#define QFS_H
+
 #include <stdio.h>
 #include <stdint.h>
 
+// Superblock feature flags
+#define QFS_FEAT_DEDUP   0x01      // Blocks are content-deduplicated and reference counted
+#define QFS_FEAT_CRC     0x02      // Every block carries a CRC32C (see qfs_crc.h)
+#define QFS_FEAT_SPARSE  0x04      // Free blocks are holes punched in the image file
+#define QFS_FEAT_PACK    0x08      // Small files inline, tails packed (see qfs_pack.h)
+
+// A block's busy byte holds its reference count, so a block can be shared
+// by at most this many files before a fresh copy has to be written.
+#define QFS_MAX_REFS     0xFF
+
 #pragma pack(push,1)
 
 // QFS Superblock Structure
@@ -19,14 +32,17 @@ typedef struct superblock {
   uint16_t  bytes_per_block;       // Number of bytes per block
   uint8_t   total_direntries;      // Total number of directory entries
   uint8_t   available_direntries;  // Number of available dir entries
-  uint8_t   reserved[8];           // Reserved, all set to 0
+  uint8_t   features;              // Optional feature flags (QFS_FEAT_*), 0 for plain QFS
+  uint16_t  tail_block;            // Tail block being filled (QFS_FEAT_PACK), 0xFFFF if none
+  uint8_t   reserved[5];           // Reserved, all set to 0
   char      label[15];             // NULL-terminated volume label (optional)
 } superblock_t;
 
 // QFS Directory Entry Structure
 typedef struct direntry {
     char     filename[23];         // NULL-terminated
-    uint8_t  permissions;          // File permissions (e.g., read, write, execute)
+    uint8_t  permissions;          // File permissions (e.g., read, write, execute);
+                                   // the top bits are QFS_PERM_* storage flags
     uint8_t  owner_id;             // Owner ID
     uint8_t  group_id;             // Group ID
     uint16_t starting_block;       // Starting block number
@@ -35,9 +51,17 @@ typedef struct direntry {
 
 // QFS File Block Structure (note that the data area size is dynamic based on bytes_per_block)
 typedef struct fileblock {
-    uint8_t  is_busy;              // Free/busy byte (1 = free, 0 = busy)
+    uint8_t  is_busy;              // Free/busy byte (0 = free, otherwise reference count)
     uint8_t  *data;                // Data area (of size bytes_per_block - 3)
     uint16_t next_block;           // Next block number (if applicable)
 } fileblock_t;
 
-#pragma pack(pop)
\ No newline at end of file
+#pragma pack(pop)
+
+// Usable payload bytes per block: everything except the busy byte, the
+// 2-byte next pointer and, on checksummed images, the 4-byte CRC32C.
+static inline uint32_t qfs_data_per_block(const superblock_t *sb) {
+    return sb->bytes_per_block - 3 - ((sb->features & QFS_FEAT_CRC) ? 4 : 0);
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+**
+** CRC32C (Castagnoli) block checksums for QFS images formatted with
+** mkfs_qfs -c (QFS_FEAT_CRC).
+**
+** On a checksummed image each block is laid out as
+**
+**   [0]                  busy byte / reference count
+**   [1 .. bps-7]         payload (qfs_data_per_block() bytes)
+**   [bps-6 .. bps-3]     CRC32C, little-endian
+**   [bps-2 .. bps-1]     next-block pointer, little-endian
+**
+** The checksum covers the payload and the next pointer. The busy byte is
+** left out on purpose: it changes whenever a shared block gains or loses a
+** reference and must not invalidate the block's contents.
+**
+** The CRC is computed with the SSE4.2 crc32 instruction (or the ARMv8 CRC
+** extension) when the CPU has it, and with a slicing-by-8 table otherwise.
+**
+** Usage: #include "qfs_crc.h"
+**
+*/
+
+#ifndef QFS_CRC_H
+#define QFS_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "qfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define QFS_CRC_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define QFS_CRC_ARM 1
+#endif
+
+#define QFS_CRC32C_POLY 0x82F63B78u   // reflected Castagnoli polynomial
+
+static uint32_t qfs_crc32c_table[8][256];
+
+static inline void qfs_crc32c_init_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ QFS_CRC32C_POLY : c >> 1;
+        qfs_crc32c_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = qfs_crc32c_table[0][n];
+        for (int t = 1; t < 8; t++) {
+            c = qfs_crc32c_table[0][c & 0xFF] ^ (c >> 8);
+            qfs_crc32c_table[t][n] = c;
+        }
+    }
+}
+
+// Portable fallback: slicing-by-8 over a little-endian word at a time.
+static inline uint32_t qfs_crc32c_sw(uint32_t crc, const uint8_t *p, size_t n) {
+    if (qfs_crc32c_table[0][1] == 0)
+        qfs_crc32c_init_table();  // lazily for callers that skip qfs_crc32c_init()
+
+    while (n && ((uintptr_t)p & 7)) {
+        crc = qfs_crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        n--;
+    }
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = qfs_crc32c_table[7][ w        & 0xFF] ^
+              qfs_crc32c_table[6][(w >>  8) & 0xFF] ^
+              qfs_crc32c_table[5][(w >> 16) & 0xFF] ^
+              qfs_crc32c_table[4][(w >> 24) & 0xFF] ^
+              qfs_crc32c_table[3][(w >> 32) & 0xFF] ^
+              qfs_crc32c_table[2][(w >> 40) & 0xFF] ^
+              qfs_crc32c_table[1][(w >> 48) & 0xFF] ^
+              qfs_crc32c_table[0][ w >> 56        ];
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = qfs_crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(QFS_CRC_X86)
+__attribute__((target("sse4.2")))
+static inline uint32_t qfs_crc32c_hw(uint32_t crc, const uint8_t *p, size_t n) {
+    while (n && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        n--;
+    }
+#if defined(__x86_64__)
+    uint64_t c64 = crc;
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c64 = _mm_crc32_u64(c64, w);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t)c64;
+#endif
+    while (n >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        crc = _mm_crc32_u32(crc, w);
+        p += 4;
+        n -= 4;
+    }
+    while (n--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#elif defined(QFS_CRC_ARM)
+static inline uint32_t qfs_crc32c_hw(uint32_t crc, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+#if defined(QFS_CRC_X86)
+static int qfs_crc32c_have_hw = -1;
+#endif
+
+// Pick the implementation and build the fallback table. Called lazily by
+// qfs_crc32c(); multithreaded callers should call it once up front.
+static inline void qfs_crc32c_init(void) {
+#if defined(QFS_CRC_X86)
+    if (qfs_crc32c_have_hw < 0) {
+        __builtin_cpu_init();
+        qfs_crc32c_have_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+#endif
+    if (qfs_crc32c_table[0][1] == 0)
+        qfs_crc32c_init_table();
+}
+
+// Continue a CRC32C over another buffer. Start with crc = 0.
+static inline uint32_t qfs_crc32c(uint32_t crc, const void *buf, size_t n) {
+    const uint8_t *p = buf;
+    crc = ~crc;
+#if defined(QFS_CRC_X86)
+    if (qfs_crc32c_have_hw < 0)
+        qfs_crc32c_init();
+    crc = qfs_crc32c_have_hw ? qfs_crc32c_hw(crc, p, n) : qfs_crc32c_sw(crc, p, n);
+#elif defined(QFS_CRC_ARM)
+    crc = qfs_crc32c_hw(crc, p, n);
+#else
+    crc = qfs_crc32c_sw(crc, p, n);
+#endif
+    return ~crc;
+}
+
+// Checksum of a framed block (payload and next pointer).
+static inline uint32_t qfs_block_crc(const superblock_t *sb, const uint8_t *block) {
+    uint32_t bpb = sb->bytes_per_block;
+    uint32_t crc = qfs_crc32c(0, block + 1, bpb - 7);
+    return qfs_crc32c(crc, block + bpb - 2, 2);
+}
+
+// Store the checksum of a framed block in its CRC field. No-op on images
+// without QFS_FEAT_CRC.
+static inline void qfs_block_seal(const superblock_t *sb, uint8_t *block) {
+    if (!(sb->features & QFS_FEAT_CRC))
+        return;
+    uint32_t crc = qfs_block_crc(sb, block);
+    uint8_t *field = block + sb->bytes_per_block - 6;
+    field[0] = crc & 0xFF;
+    field[1] = (crc >> 8) & 0xFF;
+    field[2] = (crc >> 16) & 0xFF;
+    field[3] = (crc >> 24) & 0xFF;
+}
+
+// Returns 1 if the block's stored checksum matches its contents (always 1
+// on images without QFS_FEAT_CRC).
+static inline int qfs_block_verify(const superblock_t *sb, const uint8_t *block) {
+    if (!(sb->features & QFS_FEAT_CRC))
+        return 1;
+    const uint8_t *field = block + sb->bytes_per_block - 6;
+    uint32_t stored = (uint32_t)field[0] | ((uint32_t)field[1] << 8) |
+                      ((uint32_t)field[2] << 16) | ((uint32_t)field[3] << 24);
+    return stored == qfs_block_crc(sb, block);
+}
+
+#endif
@@ -0,0 +1,242 @@
+/*
+**
+** Block generations, snapshots and deltas for QFS images.
+**
+** An image is tracked once qfs_snapshot has created its generation map,
+** kept next to it in "<image>.qgen": a header holding the image's latest
+** generation, followed by one 32-bit generation per data block. Every tool
+** that changes data blocks (write_file, delete_file, qfs_tar -x, qfsd)
+** opens the map for the operation, which takes the next generation, and
+** stamps each block with it before the block is written. Untracked images
+** have no map and the tools skip all of this. mkfs_qfs removes the map,
+** since formatting changes every block.
+**
+** qfs_snapshot writes a delta of an image since a generation: the
+** superblock and directory (always, they are small), every block stamped
+** after that generation, the generation reached and a CRC32C of the whole
+** image. qfs_sync applies a delta to a replica and checks the replica's
+** CRC32C against it. A delta since generation 0 holds every block and
+** seeds a new replica. Replicas get a map of their own, so that they can
+** in turn be snapshotted.
+**
+** Delta layout, all integers little-endian:
+**
+**   qfs_delta_header_t
+**   meta_len bytes        superblock and directory
+**   block_count records   qfs_delta_rec_t, then bytes_per_block bytes of
+**                         block contents unless the block is a hole
+**   uint32_t              CRC32C of everything before it
+**
+** Usage: #include "qfs_gen.h"
+**
+*/
+
+#ifndef QFS_GEN_H
+#define QFS_GEN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_io.h"
+
+#define QFS_GEN_MAGIC    "QGN1"
+#define QFS_DELTA_MAGIC  "QDL1"
+
+#define QFS_GEN_RUN      1024     // map entries stamped per pwrite()
+
+#define QFS_DELTA_DATA   0x00     // record is followed by the block
+#define QFS_DELTA_HOLE   0x01     // block is a hole in the source image
+
+typedef struct __attribute__((packed)) qfs_gen_header {
+    char     magic[4];
+    uint16_t total_blocks;
+    uint16_t bytes_per_block;
+    uint32_t generation;          // latest generation handed out
+    uint64_t lineage;             // shared by an image and its replicas
+} qfs_gen_header_t;
+
+typedef struct __attribute__((packed)) qfs_delta_header {
+    char     magic[4];
+    uint16_t total_blocks;
+    uint16_t bytes_per_block;
+    uint64_t lineage;
+    uint32_t base;                // changes after this generation...
+    uint32_t generation;          // ...up to and including this one
+    uint64_t image_size;          // source image size in bytes
+    uint32_t image_crc;           // CRC32C of the whole source image
+    uint32_t meta_len;            // superblock and directory bytes
+    uint32_t block_count;         // block records
+} qfs_delta_header_t;
+
+typedef struct __attribute__((packed)) qfs_delta_rec {
+    uint16_t block;
+    uint8_t  kind;                // QFS_DELTA_*
+} qfs_delta_rec_t;
+
+// A generation map opened for one operation. fd is -1 when the image is
+// not tracked, and every call is then a no-op.
+typedef struct qfs_gen {
+    int              fd;
+    int              stamped;     // header written for this generation
+    qfs_gen_header_t hdr;
+    uint32_t         first;       // run of blocks waiting to be stamped
+    uint32_t         count;
+} qfs_gen_t;
+
+static inline void qfs_gen_path(char *path, size_t len, const char *image) {
+    snprintf(path, len, "%s.qgen", image);
+}
+
+static inline off_t qfs_gen_entry(uint32_t block) {
+    return sizeof(qfs_gen_header_t) + (off_t)block * sizeof(uint32_t);
+}
+
+// Open the image's generation map, if any, and take the next generation.
+// The map stays locked until qfs_gen_close().
+static inline void qfs_gen_open(qfs_gen_t *g, const char *image) {
+    memset(g, 0, sizeof(*g));
+    char path[4096];
+    qfs_gen_path(path, sizeof(path), image);
+    g->fd = open(path, O_RDWR);
+    if (g->fd < 0)
+        return;
+    if (flock(g->fd, LOCK_EX) != 0 ||
+        qfs_io_full(g->fd, 0, &g->hdr, sizeof(g->hdr), 0) != sizeof(g->hdr) ||
+        memcmp(g->hdr.magic, QFS_GEN_MAGIC, 4) != 0) {
+        fprintf(stderr, "Warning: ignoring unreadable generation map %s.\n", path);
+        close(g->fd);
+        g->fd = -1;
+        return;
+    }
+    g->hdr.generation++;
+}
+
+static inline void qfs_gen_flush(qfs_gen_t *g) {
+    if (g->fd < 0 || g->count == 0)
+        return;
+    if (!g->stamped) {
+        // The generation is taken before any block carries it
+        qfs_io_full(g->fd, 1, &g->hdr, sizeof(g->hdr), 0);
+        g->stamped = 1;
+    }
+    uint32_t run[QFS_GEN_RUN];
+    for (uint32_t i = 0; i < QFS_GEN_RUN; i++)
+        run[i] = g->hdr.generation;
+    while (g->count > 0) {
+        uint32_t n = g->count < QFS_GEN_RUN ? g->count : QFS_GEN_RUN;
+        qfs_io_full(g->fd, 1, run, n * sizeof(uint32_t), qfs_gen_entry(g->first));
+        g->first += n;
+        g->count -= n;
+    }
+}
+
+// Stamp blocks with this operation's generation. Call before writing them.
+static inline void qfs_gen_mark(qfs_gen_t *g, const uint16_t *blocks, uint32_t n) {
+    if (g->fd < 0)
+        return;
+    for (uint32_t i = 0; i < n; i++) {
+        if (blocks[i] >= g->hdr.total_blocks)
+            continue;
+        if (g->count && blocks[i] == g->first + g->count) {
+            g->count++;
+            continue;
+        }
+        qfs_gen_flush(g);
+        g->first = blocks[i];
+        g->count = 1;
+    }
+    qfs_gen_flush(g);
+}
+
+static inline void qfs_gen_close(qfs_gen_t *g) {
+    if (g->fd < 0)
+        return;
+    qfs_gen_flush(g);
+    close(g->fd);                 // drops the lock
+    g->fd = -1;
+}
+
+// Open, stamp and close in one go, for operations that know their blocks
+// up front.
+static inline void qfs_gen_mark_image(const char *image, const uint16_t *blocks, uint32_t n) {
+    qfs_gen_t g;
+    qfs_gen_open(&g, image);
+    qfs_gen_mark(&g, blocks, n);
+    qfs_gen_close(&g);
+}
+
+// Load a whole generation map for qfs_snapshot/qfs_sync. Returns 0, or -1
+// with errno ENOENT when the image is untracked and EINVAL when the map
+// does not belong to an image of this geometry.
+static inline int qfs_gen_load(const char *image, const superblock_t *sb,
+                               qfs_gen_header_t *hdr, uint32_t **gens) {
+    char path[4096];
+    qfs_gen_path(path, sizeof(path), image);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    flock(fd, LOCK_SH);
+
+    size_t len = sizeof(uint32_t) * sb->total_blocks;
+    *gens = malloc(len ? len : 1);
+    int ok = *gens &&
+             qfs_io_full(fd, 0, hdr, sizeof(*hdr), 0) == sizeof(*hdr) &&
+             memcmp(hdr->magic, QFS_GEN_MAGIC, 4) == 0 &&
+             hdr->total_blocks == sb->total_blocks &&
+             hdr->bytes_per_block == sb->bytes_per_block &&
+             qfs_io_full(fd, 0, *gens, len, qfs_gen_entry(0)) == (ssize_t)len;
+    close(fd);
+    if (!ok) {
+        free(*gens);
+        *gens = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// Write a complete generation map, replacing any existing one.
+static inline int qfs_gen_save(const char *image, const qfs_gen_header_t *hdr,
+                               const uint32_t *gens) {
+    char path[4096];
+    qfs_gen_path(path, sizeof(path), image);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    flock(fd, LOCK_EX);
+    size_t len = sizeof(uint32_t) * hdr->total_blocks;
+    int ok = ftruncate(fd, 0) == 0 &&
+             qfs_io_full(fd, 1, (void *)hdr, sizeof(*hdr), 0) == sizeof(*hdr) &&
+             qfs_io_full(fd, 1, (void *)gens, len, qfs_gen_entry(0)) == (ssize_t)len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// CRC32C of the first 'size' bytes of an image, as recorded in deltas.
+static inline int qfs_gen_image_crc(int fd, uint64_t size, uint32_t *crc) {
+    uint8_t *buf = malloc(1 << 20);
+    if (!buf)
+        return -1;
+    uint32_t sum = 0;
+    for (uint64_t off = 0; off < size; ) {
+        size_t n = size - off < (1 << 20) ? (size_t)(size - off) : (1 << 20);
+        if (qfs_io_full(fd, 0, buf, n, (off_t)off) != (ssize_t)n) {
+            free(buf);
+            return -1;
+        }
+        sum = qfs_crc32c(sum, buf, n);
+        off += n;
+    }
+    free(buf);
+    *crc = sum;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,657 @@
+/*
+**
+** Asynchronous block I/O for QFS tools.
+**
+** Requests are queued with qfs_io_queue(), handed to the kernel with
+** qfs_io_submit() and collected one completion at a time with
+** qfs_io_wait(). On Linux the queue is an io_uring driven through raw
+** system calls, so there is no dependency on liburing. Where io_uring is
+** unavailable (older kernels, seccomp filters, other systems) the same
+** calls fall back to plain pread()/pwrite() performed at submit time.
+** Setting QFS_IO=pread in the environment forces the fallback.
+**
+** Setting QFS_DIRECT=1 makes the tools that scan or stream the image
+** (read_file, recover_files, qfs_scrub) open it with O_DIRECT, so bulk
+** reads bypass the page cache instead of evicting other processes' data.
+** Direct reads need aligned buffers, offsets and lengths: buffers come from
+** a qfs_pool_t, and qfs_io_read_span() widens any range (such as the 32-byte
+** superblock or the directory) to the enclosing aligned region. Where the
+** filesystem refuses O_DIRECT the image is read normally and the pages are
+** dropped from the cache with posix_fadvise() after use.
+**
+** On sparse images (mkfs_qfs -s) free blocks are holes in the image file.
+** qfs_io_punch() creates them, and qfs_io_in_hole()/qfs_io_range_is_hole()
+** let scans skip them with SEEK_DATA/SEEK_HOLE instead of reading zeros.
+** All three degrade gracefully on filesystems without hole support.
+**
+** qfs_chain_* builds on this to walk a file's block chain with many reads
+** in flight: blocks are requested ahead on the assumption that the chain
+** continues into the next block on disk (which is how write_file allocates
+** them), and the read-ahead is discarded and restarted whenever a next
+** pointer jumps elsewhere. The next pointers of each completed run are
+** decoded in one pass by the image's block kernels (see qfs_kernels.h).
+**
+** Usage: #include "qfs_io.h"
+**
+*/
+
+#ifndef QFS_IO_H
+#define QFS_IO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include "qfs.h"
+#include "qfs_kernels.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define QFS_HAVE_URING 1
+#endif
+#endif
+
+#define QFS_IO_DEPTH 64           // maximum requests in flight
+#define QFS_IO_ALIGN 4096         // alignment of direct I/O buffers, offsets and lengths
+
+// How an image was opened by qfs_io_open()
+#define QFS_IO_BUFFERED 0         // normal page-cached I/O
+#define QFS_IO_DIRECT   1         // O_DIRECT
+#define QFS_IO_UNCACHED 2         // direct I/O unavailable; cache dropped after use
+
+typedef struct qfs_io_req {
+    int       write;
+    void     *buf;
+    size_t    len;
+    off_t     off;
+    uint64_t  tag;
+    ssize_t   res;
+} qfs_io_req_t;
+
+typedef struct qfs_io {
+    int           fd;
+    int           direct;         // fd was opened with O_DIRECT
+    int           uring;          // 1 when backed by io_uring
+    unsigned      queued;         // prepared but not yet submitted
+    unsigned      inflight;       // submitted but not yet reaped
+
+    // pread() fallback: queued requests, then finished ones awaiting qfs_io_wait()
+    qfs_io_req_t  pending[QFS_IO_DEPTH];
+    qfs_io_req_t  done[QFS_IO_DEPTH];
+    unsigned      done_head, done_count;
+
+#ifdef QFS_HAVE_URING
+    int           ring_fd;
+    void         *sq_ptr, *cq_ptr;
+    size_t        sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t        sqes_size;
+    unsigned     *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned     *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    qfs_io_req_t  reqs[QFS_IO_DEPTH];   // request slot for each in-flight tag
+    unsigned      free_slots[QFS_IO_DEPTH];
+    unsigned      nfree;
+#endif
+} qfs_io_t;
+
+// Read or write the whole range, retrying short transfers.
+static inline ssize_t qfs_io_full(int fd, int write, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write ? pwrite(fd, (uint8_t *)buf + done, len - done, off + done)
+                          : pread(fd, (uint8_t *)buf + done, len - done, off + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return done ? (ssize_t)done : -errno;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static inline size_t qfs_io_align_up(size_t n) {
+    return (n + QFS_IO_ALIGN - 1) & ~(size_t)(QFS_IO_ALIGN - 1);
+}
+
+// Open an image for bulk access. With QFS_DIRECT set in the environment
+// this tries O_DIRECT first; *mode reports which QFS_IO_* mode applies.
+static inline int qfs_io_open(const char *path, int flags, int *mode) {
+    const char *env = getenv("QFS_DIRECT");
+    int want_direct = env && *env && strcmp(env, "0") != 0;
+
+    *mode = QFS_IO_BUFFERED;
+    if (want_direct) {
+#ifdef O_DIRECT
+        int fd = open(path, flags | O_DIRECT);
+        if (fd >= 0) {
+            *mode = QFS_IO_DIRECT;
+            return fd;
+        }
+        if (errno != EINVAL)
+            return -1;
+#endif
+        *mode = QFS_IO_UNCACHED;
+    }
+    return open(path, flags);
+}
+
+// Tell the kernel a range will not be read again (QFS_IO_UNCACHED only).
+static inline void qfs_io_release(int fd, int mode, off_t off, size_t len) {
+#ifdef POSIX_FADV_DONTNEED
+    if (mode == QFS_IO_UNCACHED)
+        posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+#else
+    (void)fd; (void)mode; (void)off; (void)len;
+#endif
+}
+
+// Pool of equally sized, QFS_IO_ALIGN-aligned buffers carved from one slab,
+// so direct I/O never needs a per-request aligned allocation.
+typedef struct qfs_pool {
+    uint8_t  *slab;
+    size_t    size;               // bytes per buffer (multiple of QFS_IO_ALIGN)
+    unsigned  count;
+    unsigned  nfree;
+    uint8_t **free;
+} qfs_pool_t;
+
+static inline int qfs_pool_init(qfs_pool_t *pool, size_t size, unsigned count) {
+    void *slab = NULL;
+    pool->size = qfs_io_align_up(size);
+    pool->count = count;
+    pool->nfree = 0;
+    pool->free = malloc(sizeof(uint8_t *) * count);
+    if (!pool->free || posix_memalign(&slab, QFS_IO_ALIGN, pool->size * count) != 0) {
+        free(pool->free);
+        pool->free = NULL;
+        pool->slab = NULL;
+        return -1;
+    }
+    pool->slab = slab;
+    for (unsigned i = count; i-- > 0; )
+        pool->free[pool->nfree++] = pool->slab + (size_t)i * pool->size;
+    return 0;
+}
+
+static inline uint8_t *qfs_pool_get(qfs_pool_t *pool) {
+    return pool->nfree ? pool->free[--pool->nfree] : NULL;
+}
+
+static inline void qfs_pool_put(qfs_pool_t *pool, uint8_t *buf) {
+    pool->free[pool->nfree++] = buf;
+}
+
+static inline void qfs_pool_destroy(qfs_pool_t *pool) {
+    free(pool->slab);
+    free(pool->free);
+    pool->slab = NULL;
+    pool->free = NULL;
+}
+
+// Deallocate [off, off + len) in the image file; the range reads back as
+// zeros afterwards. Returns -1 if the filesystem cannot punch holes.
+static inline int qfs_io_punch(int fd, off_t off, off_t len) {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+#else
+    (void)fd; (void)off; (void)len;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+// Cached SEEK_DATA/SEEK_HOLE answer for scans that walk the image in
+// ascending order: [lo, data) is a hole and [data, end) is data.
+typedef struct qfs_holes {
+    int    fd;
+    off_t  lo, data, end;
+} qfs_holes_t;
+
+static inline void qfs_holes_init(qfs_holes_t *h, int fd) {
+    h->fd = fd;
+    h->lo = h->data = h->end = 0;
+}
+
+// Returns 1 if the byte at 'off' lies in a hole, i.e. reads as zero
+// without touching the disk. Always 0 where holes are not reported.
+static inline int qfs_io_in_hole(qfs_holes_t *h, off_t off) {
+    if (off < h->lo || off >= h->end) {
+        h->lo = off;
+#ifdef SEEK_DATA
+        off_t data = lseek(h->fd, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            h->data = h->end = INT64_MAX;          // hole up to end of file
+        } else if (data < 0) {
+            h->data = off;                          // no hole information
+            h->end = INT64_MAX;
+        } else {
+            off_t hole = lseek(h->fd, data, SEEK_HOLE);
+            h->data = data;
+            h->end = hole > data ? hole : INT64_MAX;
+        }
+#else
+        h->data = off;
+        h->end = INT64_MAX;
+#endif
+    }
+    return off < h->data;
+}
+
+// Returns 1 if all of [off, off + len) lies in a hole.
+static inline int qfs_io_range_is_hole(int fd, off_t off, off_t len) {
+    qfs_holes_t h;
+    qfs_holes_init(&h, fd);
+    return qfs_io_in_hole(&h, off) && h.data >= off + len;
+}
+
+// Bytes of aligned buffer needed to read 'len' bytes at any offset.
+static inline size_t qfs_io_span(size_t len) {
+    return qfs_io_align_up(len) + QFS_IO_ALIGN;
+}
+
+// Read [off, off + len) by reading the enclosing aligned region into the
+// aligned buffer 'abuf' (at least qfs_io_span(len) bytes). Returns a
+// pointer to the requested bytes inside 'abuf', or NULL on a short read.
+static inline const uint8_t *qfs_io_read_span(int fd, uint8_t *abuf, size_t len, off_t off) {
+    off_t start = off & ~(off_t)(QFS_IO_ALIGN - 1);
+    size_t skew = (size_t)(off - start);
+    ssize_t r = qfs_io_full(fd, 0, abuf, qfs_io_align_up(skew + len), start);
+    if (r < 0 || (size_t)r < skew + len)
+        return NULL;
+    return abuf + skew;
+}
+
+#ifdef QFS_HAVE_URING
+static inline int qfs_uring_setup(qfs_io_t *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = (int)syscall(__NR_io_uring_setup, QFS_IO_DEPTH, &p);
+    if (rfd < 0)
+        return -1;
+
+    io->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        if (io->cq_size > io->sq_size)
+            io->sq_size = io->cq_size;
+        io->cq_size = io->sq_size;
+    }
+
+    io->sq_ptr = mmap(NULL, io->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    if (io->sq_ptr == MAP_FAILED) {
+        close(rfd);
+        return -1;
+    }
+    io->cq_ptr = single ? io->sq_ptr
+                        : mmap(NULL, io->cq_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+    if (io->cq_ptr == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED)
+            munmap(io->sqes, io->sqes_size);
+        if (!single && io->cq_ptr != MAP_FAILED)
+            munmap(io->cq_ptr, io->cq_size);
+        munmap(io->sq_ptr, io->sq_size);
+        close(rfd);
+        return -1;
+    }
+
+    uint8_t *sq = io->sq_ptr, *cq = io->cq_ptr;
+    io->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    io->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    io->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + p.sq_off.array);
+    io->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    io->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    io->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    io->ring_fd = rfd;
+    io->nfree = QFS_IO_DEPTH;
+    for (unsigned i = 0; i < QFS_IO_DEPTH; i++)
+        io->free_slots[i] = QFS_IO_DEPTH - 1 - i;
+    return 0;
+}
+#endif
+
+// Attach a queue to an open file descriptor. Always succeeds; the pread()
+// fallback is used when io_uring cannot be set up.
+static inline void qfs_io_init(qfs_io_t *io, int fd) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+#ifdef QFS_HAVE_URING
+    const char *mode = getenv("QFS_IO");
+    if (!(mode && strcmp(mode, "pread") == 0) && qfs_uring_setup(io) == 0)
+        io->uring = 1;
+#endif
+}
+
+// Queue a read (write = 0) or write (write = 1). Returns -1 if the queue
+// is full; submit and wait for completions before queueing more.
+static inline int qfs_io_queue(qfs_io_t *io, int write, void *buf, size_t len,
+                               off_t off, uint64_t tag) {
+    if (io->queued + io->inflight >= QFS_IO_DEPTH)
+        return -1;
+
+#ifdef QFS_HAVE_URING
+    if (io->uring) {
+        unsigned slot = io->free_slots[--io->nfree];
+        qfs_io_req_t *r = &io->reqs[slot];
+        r->write = write; r->buf = buf; r->len = len; r->off = off; r->tag = tag;
+
+        unsigned tail = *io->sq_tail;
+        unsigned idx = tail & *io->sq_mask;
+        struct io_uring_sqe *sqe = &io->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = io->fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->off = (uint64_t)off;
+        sqe->user_data = slot;
+        io->sq_array[idx] = idx;
+        __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        io->queued++;
+        return 0;
+    }
+#endif
+
+    qfs_io_req_t *r = &io->pending[io->queued++];
+    r->write = write; r->buf = buf; r->len = len; r->off = off; r->tag = tag;
+    return 0;
+}
+
+// Hand all queued requests to the kernel (or perform them, in fallback mode).
+static inline int qfs_io_submit(qfs_io_t *io) {
+    if (io->queued == 0)
+        return 0;
+
+#ifdef QFS_HAVE_URING
+    if (io->uring) {
+        unsigned todo = io->queued;
+        while (todo > 0) {
+            int r = (int)syscall(__NR_io_uring_enter, io->ring_fd, todo, 0, 0, NULL, 0);
+            if (r < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                return -1;
+            }
+            todo -= r;
+            io->queued -= r;
+            io->inflight += r;
+        }
+        return 0;
+    }
+#endif
+
+    for (unsigned i = 0; i < io->queued; i++) {
+        qfs_io_req_t *r = &io->pending[i];
+        r->res = qfs_io_full(io->fd, r->write, r->buf, r->len, r->off);
+        io->done[(io->done_head + io->done_count++) % QFS_IO_DEPTH] = *r;
+    }
+    io->inflight += io->queued;
+    io->queued = 0;
+    return 0;
+}
+
+// Wait for one completion. Stores the request's tag and result (bytes
+// transferred or -errno) and returns 0, or returns -1 if nothing is in flight.
+static inline int qfs_io_wait(qfs_io_t *io, uint64_t *tag, ssize_t *res) {
+    if (io->inflight == 0)
+        return -1;
+
+#ifdef QFS_HAVE_URING
+    if (io->uring) {
+        for (;;) {
+            unsigned head = *io->cq_head;
+            if (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+                unsigned slot = (unsigned)cqe->user_data;
+                ssize_t r = cqe->res;
+                __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+                qfs_io_req_t *q = &io->reqs[slot];
+                // Finish short transfers synchronously
+                if (r >= 0 && (size_t)r < q->len) {
+                    ssize_t more = qfs_io_full(io->fd, q->write, (uint8_t *)q->buf + r,
+                                               q->len - r, q->off + r);
+                    if (more > 0)
+                        r += more;
+                }
+                *tag = q->tag;
+                *res = r;
+                io->free_slots[io->nfree++] = slot;
+                io->inflight--;
+                return 0;
+            }
+            int e = (int)syscall(__NR_io_uring_enter, io->ring_fd, 0, 1,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+            if (e < 0 && errno != EINTR)
+                return -1;
+        }
+    }
+#endif
+
+    qfs_io_req_t *r = &io->done[io->done_head];
+    io->done_head = (io->done_head + 1) % QFS_IO_DEPTH;
+    io->done_count--;
+    io->inflight--;
+    *tag = r->tag;
+    *res = r->res;
+    return 0;
+}
+
+static inline void qfs_io_close(qfs_io_t *io) {
+    uint64_t tag;
+    ssize_t res;
+    qfs_io_submit(io);
+    while (qfs_io_wait(io, &tag, &res) == 0)
+        ;
+#ifdef QFS_HAVE_URING
+    if (io->uring) {
+        munmap(io->sqes, io->sqes_size);
+        if (io->cq_ptr != io->sq_ptr)
+            munmap(io->cq_ptr, io->cq_size);
+        munmap(io->sq_ptr, io->sq_size);
+        close(io->ring_fd);
+        io->uring = 0;
+    }
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Block chain traversal with read-ahead
+// ---------------------------------------------------------------------------
+
+#define QFS_CHAIN_RUN   16        // blocks per read request
+#define QFS_CHAIN_RUNS  8         // read requests kept in flight
+
+typedef struct qfs_chain_run {
+    uint32_t  first;              // first block number of the run
+    uint32_t  count;              // number of blocks in the run
+    size_t    skew;               // bytes read before the first block (direct I/O alignment)
+    int       done;               // read has completed
+    int       decoded;            // next pointers extracted into qfs_chain_t.next
+    ssize_t   res;
+} qfs_chain_run_t;
+
+typedef struct qfs_chain {
+    qfs_io_t           *io;
+    const superblock_t *sb;
+    qfs_kernels_t       kern;
+    off_t               data_start;
+    qfs_pool_t          pool;      // one aligned buffer per run
+    uint8_t            *bufs[QFS_CHAIN_RUNS];
+    qfs_chain_run_t     run[QFS_CHAIN_RUNS];
+    uint16_t            next[QFS_CHAIN_RUNS][QFS_CHAIN_RUN];  // per run, once decoded
+    unsigned            head;      // oldest run in the ring
+    unsigned            nruns;     // runs in the ring
+    unsigned            pos;       // next block within the head run
+    uint32_t            predict;   // block number the next run starts at
+    uint32_t            expected;  // chain length implied by the file size
+    uint32_t            requested; // chain positions covered by queued runs
+    uint32_t            consumed;  // blocks handed to the caller
+    uint32_t            cur;       // next block of the chain (0xFFFF at end)
+    int                 error;
+} qfs_chain_t;
+
+// Prepare to walk the chain starting at 'start'. 'expected' is the number
+// of blocks the chain should have; it only bounds the read-ahead.
+static inline int qfs_chain_open(qfs_chain_t *c, qfs_io_t *io, const superblock_t *sb,
+                                 uint16_t start, uint32_t expected) {
+    memset(c, 0, sizeof(*c));
+    c->io = io;
+    c->sb = sb;
+    qfs_kernels_init(&c->kern, sb);
+    c->data_start = sizeof(superblock_t) + (off_t)sizeof(direntry_t) * sb->total_direntries;
+    c->predict = start;
+    c->cur = start;
+    c->expected = expected;
+
+    // Room for a full run plus the alignment slack of a direct read
+    if (qfs_pool_init(&c->pool, qfs_io_span((size_t)sb->bytes_per_block * QFS_CHAIN_RUN),
+                      QFS_CHAIN_RUNS) != 0)
+        return -1;
+    for (unsigned i = 0; i < QFS_CHAIN_RUNS; i++)
+        c->bufs[i] = qfs_pool_get(&c->pool);
+    return 0;
+}
+
+// Wait until the run in ring slot 'slot' has completed.
+static inline int qfs_chain_wait_run(qfs_chain_t *c, unsigned slot) {
+    while (!c->run[slot].done) {
+        uint64_t tag;
+        ssize_t res;
+        if (qfs_io_wait(c->io, &tag, &res) != 0)
+            return -1;
+        c->run[tag].done = 1;
+        c->run[tag].res = res;
+    }
+    return 0;
+}
+
+// Drop all read-ahead, waiting for reads still in flight so that their
+// buffers can be reused.
+static inline void qfs_chain_reset(qfs_chain_t *c, uint32_t next) {
+    for (unsigned i = 0; i < c->nruns; i++)
+        qfs_chain_wait_run(c, (c->head + i) % QFS_CHAIN_RUNS);
+    c->nruns = 0;
+    c->pos = 0;
+    c->requested = c->consumed;
+    c->predict = next;
+}
+
+// Return the next block of the chain and store its number in *block, or
+// NULL at the end of the chain or on error (c->error is then set). The
+// returned buffer stays valid until the following call.
+static inline const uint8_t *qfs_chain_next(qfs_chain_t *c, uint16_t *block) {
+    uint32_t bpb = c->kern.bpb;
+
+    // Retire the head run once all of its blocks have been returned
+    if (c->nruns && c->pos == c->run[c->head].count) {
+        c->head = (c->head + 1) % QFS_CHAIN_RUNS;
+        c->nruns--;
+        c->pos = 0;
+    }
+
+    if (c->cur == 0xFFFF)
+        return NULL;
+    if (c->cur >= c->sb->total_blocks) {
+        c->error = 1;
+        return NULL;
+    }
+
+    // Keep the ring full of runs predicted to follow on from the last one.
+    // Past the expected length only the block actually needed is read.
+    while (c->nruns < QFS_CHAIN_RUNS && c->predict < c->sb->total_blocks) {
+        uint32_t budget = c->expected > c->requested ? c->expected - c->requested : 0;
+        if (budget == 0 && c->nruns == 0)
+            budget = 1;
+        if (budget == 0)
+            break;
+        uint32_t count = budget < QFS_CHAIN_RUN ? budget : QFS_CHAIN_RUN;
+        if (count > c->sb->total_blocks - c->predict)
+            count = c->sb->total_blocks - c->predict;
+
+        // Direct I/O reads the enclosing aligned range instead
+        unsigned slot = (c->head + c->nruns) % QFS_CHAIN_RUNS;
+        off_t off = c->data_start + (off_t)c->predict * bpb;
+        size_t len = (size_t)count * bpb;
+        size_t skew = 0;
+        if (c->io->direct) {
+            skew = (size_t)(off & (QFS_IO_ALIGN - 1));
+            off -= skew;
+            len = qfs_io_align_up(skew + len);
+        }
+        if (qfs_io_queue(c->io, 0, c->bufs[slot], len, off, slot) != 0)
+            break;
+        c->run[slot].first = c->predict;
+        c->run[slot].count = count;
+        c->run[slot].skew = skew;
+        c->run[slot].done = 0;
+        c->run[slot].decoded = 0;
+        c->nruns++;
+        c->predict += count;
+        c->requested += count;
+    }
+    if (qfs_io_submit(c->io) != 0 || c->nruns == 0) {
+        c->error = 1;
+        return NULL;
+    }
+
+    qfs_chain_run_t *r = &c->run[c->head];
+    if (qfs_chain_wait_run(c, c->head) != 0 ||
+        r->res < (ssize_t)(r->skew + (size_t)r->count * bpb) ||
+        r->first + c->pos != c->cur) {
+        c->error = 1;
+        return NULL;
+    }
+
+    const uint8_t *first = c->bufs[c->head] + r->skew;
+    if (!r->decoded) {
+        c->kern.links(&c->kern, first, r->count, c->next[c->head]);
+        r->decoded = 1;
+    }
+    const uint8_t *buf = first + (size_t)c->pos * bpb;
+    uint16_t next = c->next[c->head][c->pos];
+
+    *block = (uint16_t)c->cur;
+    c->pos++;
+    c->consumed++;
+
+    // If the chain does not continue where the read-ahead assumed, throw
+    // the read-ahead away and restart it from the real next block.
+    int more_ahead = c->pos < r->count || c->nruns > 1;
+    uint32_t assumed = c->cur + 1;
+    if (next != 0xFFFF && (!more_ahead || next != assumed)) {
+        // Keep the head run (it holds the returned buffer) but nothing else
+        for (unsigned i = 1; i < c->nruns; i++)
+            qfs_chain_wait_run(c, (c->head + i) % QFS_CHAIN_RUNS);
+        c->nruns = 1;
+        r->count = c->pos;
+        c->requested = c->consumed;
+        c->predict = next;
+    }
+    c->cur = next;
+    return buf;
+}
+
+static inline void qfs_chain_close(qfs_chain_t *c) {
+    qfs_chain_reset(c, 0xFFFF);
+    qfs_pool_destroy(&c->pool);
+}
+
+#endif
@@ -0,0 +1,186 @@
+/*
+**
+** Block kernels specialized for common block sizes.
+**
+** The per-block work on the hot paths (framing payloads into blocks,
+** setting and decoding next pointers, checking checksums) depends on
+** bytes_per_block only through a few offsets. Written against the value
+** read from the superblock, every offset is a runtime computation and the
+** loops over runs of blocks cannot be unrolled or vectorized.
+**
+** Each kernel below is therefore written once as an always-inline body
+** taking the block size and checksum layout as parameters, and instantiated
+** with those as constants for 512- and 4096-byte blocks, with and without
+** QFS_FEAT_CRC. A generic instance reads them from the qfs_kernels_t and
+** covers any other block size. qfs_kernels_init() picks the instance for an
+** image once, when it is opened; callers then go through the function
+** pointers, one call per run of blocks.
+**
+** Usage: #include "qfs_kernels.h"
+**
+*/
+
+#ifndef QFS_KERNELS_H
+#define QFS_KERNELS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+
+typedef struct qfs_kernels qfs_kernels_t;
+
+struct qfs_kernels {
+    uint32_t    bpb;              // bytes per block
+    uint32_t    dpb;              // payload bytes per block
+    int         crc;              // blocks carry a CRC32C
+    const char *name;             // "512", "4096c", ..., or "generic"
+
+    // Frame n consecutive blocks whose payloads are already in place: the
+    // first 'bytes' payload bytes of the run are data, the rest is cleared.
+    // Block k gets busy byte 1 and next pointer next[k], and is sealed.
+    void (*frame)(const qfs_kernels_t *k, uint8_t *frames, uint32_t n,
+                  size_t bytes, const uint16_t *next);
+
+    // Set one framed block's next pointer and seal it again.
+    void (*link)(const qfs_kernels_t *k, uint8_t *block, uint16_t next);
+
+    // Decode the next pointers of n consecutive blocks into next[].
+    void (*links)(const qfs_kernels_t *k, const uint8_t *blocks, uint32_t n,
+                  uint16_t *next);
+
+    // Returns 1 if the block's checksum matches (always 1 without CRCs).
+    int  (*verify)(const qfs_kernels_t *k, const uint8_t *block);
+};
+
+static inline __attribute__((always_inline))
+void qfs_kernel_seal(uint32_t bpb, uint8_t *block) {
+    uint32_t crc = qfs_crc32c(0, block + 1, bpb - 7);
+    crc = qfs_crc32c(crc, block + bpb - 2, 2);
+    uint8_t *field = block + bpb - 6;
+    field[0] = crc & 0xFF;
+    field[1] = (crc >> 8) & 0xFF;
+    field[2] = (crc >> 16) & 0xFF;
+    field[3] = (crc >> 24) & 0xFF;
+}
+
+static inline __attribute__((always_inline))
+void qfs_kernel_frame(uint32_t bpb, int crc, uint8_t *frames, uint32_t n,
+                      size_t bytes, const uint16_t *next) {
+    uint32_t dpb = bpb - 3 - (crc ? 4 : 0);
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *block = frames + (size_t)i * bpb;
+        uint32_t have = bytes > dpb ? dpb : (uint32_t)bytes;
+        bytes -= have;
+        block[0] = 0x01;
+        if (have < dpb)
+            memset(block + 1 + have, 0, dpb - have);
+        block[bpb - 2] = next[i] & 0xFF;
+        block[bpb - 1] = (next[i] >> 8) & 0xFF;
+        if (crc)
+            qfs_kernel_seal(bpb, block);
+    }
+}
+
+static inline __attribute__((always_inline))
+void qfs_kernel_link(uint32_t bpb, int crc, uint8_t *block, uint16_t next) {
+    block[bpb - 2] = next & 0xFF;
+    block[bpb - 1] = (next >> 8) & 0xFF;
+    if (crc)
+        qfs_kernel_seal(bpb, block);
+}
+
+static inline __attribute__((always_inline))
+void qfs_kernel_links(uint32_t bpb, const uint8_t *blocks, uint32_t n, uint16_t *next) {
+    const uint8_t *p = blocks + bpb - 2;
+    for (uint32_t i = 0; i < n; i++, p += bpb)
+        next[i] = (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline __attribute__((always_inline))
+int qfs_kernel_verify(uint32_t bpb, int crc, const uint8_t *block) {
+    if (!crc)
+        return 1;
+    const uint8_t *field = block + bpb - 6;
+    uint32_t stored = (uint32_t)field[0] | ((uint32_t)field[1] << 8) |
+                      ((uint32_t)field[2] << 16) | ((uint32_t)field[3] << 24);
+    uint32_t sum = qfs_crc32c(0, block + 1, bpb - 7);
+    return stored == qfs_crc32c(sum, block + bpb - 2, 2);
+}
+
+// One instance of every kernel for a fixed block size and CRC layout.
+#define QFS_KERNELS_FIXED(NAME, BPB, CRC)                                          \
+    static inline void qfs_frame_##NAME(const qfs_kernels_t *k, uint8_t *frames,   \
+                                        uint32_t n, size_t bytes,                  \
+                                        const uint16_t *next) {                    \
+        (void)k;                                                                   \
+        qfs_kernel_frame(BPB, CRC, frames, n, bytes, next);                        \
+    }                                                                              \
+    static inline void qfs_link_##NAME(const qfs_kernels_t *k, uint8_t *block,     \
+                                       uint16_t next) {                            \
+        (void)k;                                                                   \
+        qfs_kernel_link(BPB, CRC, block, next);                                    \
+    }                                                                              \
+    static inline void qfs_links_##NAME(const qfs_kernels_t *k,                    \
+                                        const uint8_t *blocks, uint32_t n,         \
+                                        uint16_t *next) {                          \
+        (void)k;                                                                   \
+        qfs_kernel_links(BPB, blocks, n, next);                                    \
+    }                                                                              \
+    static inline int qfs_verify_##NAME(const qfs_kernels_t *k,                    \
+                                        const uint8_t *block) {                    \
+        (void)k;                                                                   \
+        return qfs_kernel_verify(BPB, CRC, block);                                 \
+    }
+
+QFS_KERNELS_FIXED(512, 512, 0)
+QFS_KERNELS_FIXED(512c, 512, 1)
+QFS_KERNELS_FIXED(4096, 4096, 0)
+QFS_KERNELS_FIXED(4096c, 4096, 1)
+
+static inline void qfs_frame_generic(const qfs_kernels_t *k, uint8_t *frames, uint32_t n,
+                                     size_t bytes, const uint16_t *next) {
+    qfs_kernel_frame(k->bpb, k->crc, frames, n, bytes, next);
+}
+
+static inline void qfs_link_generic(const qfs_kernels_t *k, uint8_t *block, uint16_t next) {
+    qfs_kernel_link(k->bpb, k->crc, block, next);
+}
+
+static inline void qfs_links_generic(const qfs_kernels_t *k, const uint8_t *blocks,
+                                     uint32_t n, uint16_t *next) {
+    qfs_kernel_links(k->bpb, blocks, n, next);
+}
+
+static inline int qfs_verify_generic(const qfs_kernels_t *k, const uint8_t *block) {
+    return qfs_kernel_verify(k->bpb, k->crc, block);
+}
+
+#define QFS_KERNELS_USE(K, NAME)                  \
+    do {                                          \
+        (K)->name = #NAME;                        \
+        (K)->frame = qfs_frame_##NAME;            \
+        (K)->link = qfs_link_##NAME;              \
+        (K)->links = qfs_links_##NAME;            \
+        (K)->verify = qfs_verify_##NAME;          \
+    } while (0)
+
+// Select the kernels for an image's block size and layout.
+static inline void qfs_kernels_init(qfs_kernels_t *k, const superblock_t *sb) {
+    k->bpb = sb->bytes_per_block;
+    k->dpb = qfs_data_per_block(sb);
+    k->crc = (sb->features & QFS_FEAT_CRC) != 0;
+
+    if (k->bpb == 512 && !k->crc)
+        QFS_KERNELS_USE(k, 512);
+    else if (k->bpb == 512)
+        QFS_KERNELS_USE(k, 512c);
+    else if (k->bpb == 4096 && !k->crc)
+        QFS_KERNELS_USE(k, 4096);
+    else if (k->bpb == 4096)
+        QFS_KERNELS_USE(k, 4096c);
+    else
+        QFS_KERNELS_USE(k, generic);
+}
+
+#endif
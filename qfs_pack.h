@@ -0,0 +1,148 @@
+/*
+**
+** Inline storage and tail packing for QFS images formatted with
+** mkfs_qfs -p (QFS_FEAT_PACK).
+**
+** Inline files (QFS_PERM_INLINE) keep their data in the directory itself:
+** the file's entry is followed by up to QFS_INLINE_MAX_SLOTS continuation
+** records, each holding a QFS_DIRENT_CONT marker byte and 31 bytes of data.
+** Such a file has no data blocks at all (starting_block = 0xFFFF), which
+** includes every empty file.
+**
+** Tail-packed files (QFS_PERM_TAIL) store their full blocks as usual, but
+** the final partial block is replaced by a slice of a shared tail block:
+** the last full block's next pointer (or starting_block, for a file with
+** no full blocks) names the tail block. A tail block's payload is
+**
+**   [0]              number of slices
+**   [1 + 5*i ...]    slice i: owner's directory index (u8),
+**                    offset (u16 LE) and length (u16 LE) of its bytes
+**   ... free ...
+**   [... end]        slice data, packed downwards from the end of the payload
+**
+** Its busy byte counts the slices and its next pointer is 0xFFFF. The
+** superblock's tail_block names the tail block new tails are added to.
+**
+** Usage: #include "qfs_pack.h"
+**
+*/
+
+#ifndef QFS_PACK_H
+#define QFS_PACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+
+#define QFS_PERM_INLINE      0x80  // file data lives in the directory
+#define QFS_PERM_TAIL        0x40  // last partial block packed into a tail block
+#define QFS_DIRENT_CONT      0x01  // filename[0] of an inline continuation record
+
+#define QFS_INLINE_PER_SLOT  (sizeof(direntry_t) - 1)
+#define QFS_INLINE_MAX_SLOTS 4
+#define QFS_INLINE_MAX       (QFS_INLINE_MAX_SLOTS * QFS_INLINE_PER_SLOT)
+
+#define QFS_TAIL_SLICE_SIZE  5     // bytes per slice table entry
+
+// Continuation records needed for an inline file of 'size' bytes.
+static inline uint32_t qfs_inline_slots(uint32_t size) {
+    return (size + QFS_INLINE_PER_SLOT - 1) / QFS_INLINE_PER_SLOT;
+}
+
+// Tails at most half a block long are packed; longer ones keep a block.
+static inline int qfs_tail_packable(const superblock_t *sb, uint32_t tail) {
+    return tail > 0 && tail <= qfs_data_per_block(sb) / 2;
+}
+
+// Find dir_index's slice in a tail block. Returns 0 and sets *data/*len,
+// or -1 if the block holds no slice for that entry.
+static inline int qfs_tail_find(const superblock_t *sb, const uint8_t *block,
+                                uint8_t dir_index, const uint8_t **data, uint16_t *len) {
+    const uint8_t *payload = block + 1;
+    uint32_t dpb = qfs_data_per_block(sb);
+    uint8_t n = payload[0];
+
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *e = payload + 1 + QFS_TAIL_SLICE_SIZE * i;
+        uint16_t off = e[1] | (e[2] << 8);
+        uint16_t l = e[3] | (e[4] << 8);
+        if (e[0] == dir_index && (uint32_t)off + l <= dpb) {
+            *data = payload + off;
+            *len = l;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Rebuild a tail block keeping every slice except 'drop' (-1 keeps all),
+// then append (dir_index, data, len) if data is not NULL. Slices are
+// repacked against the end of the payload, so freed space is reclaimed.
+// Updates the busy byte, next pointer and checksum. Returns -1, leaving the
+// block untouched, if the new slice does not fit.
+static inline int qfs_tail_rebuild(const superblock_t *sb, uint8_t *block, int drop,
+                                   uint8_t dir_index, const uint8_t *data, uint16_t len) {
+    uint32_t bpb = sb->bytes_per_block;
+    uint32_t dpb = qfs_data_per_block(sb);
+    uint8_t *old = block + 1;
+    uint8_t n = old[0];
+
+    uint8_t *payload = calloc(1, dpb);
+    if (!payload)
+        return -1;
+
+    uint32_t count = 0;
+    uint32_t end = dpb;              // data grows downwards from here
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *e = old + 1 + QFS_TAIL_SLICE_SIZE * i;
+        uint16_t off = e[1] | (e[2] << 8);
+        uint16_t l = e[3] | (e[4] << 8);
+        if (e[0] == drop || (uint32_t)off + l > dpb)
+            continue;
+
+        end -= l;
+        memcpy(payload + end, old + off, l);
+        uint8_t *d = payload + 1 + QFS_TAIL_SLICE_SIZE * count++;
+        d[0] = e[0];
+        d[1] = end & 0xFF;
+        d[2] = (end >> 8) & 0xFF;
+        d[3] = l & 0xFF;
+        d[4] = (l >> 8) & 0xFF;
+    }
+
+    if (data) {
+        uint32_t table_end = 1 + QFS_TAIL_SLICE_SIZE * (count + 1);
+        if (count >= QFS_MAX_REFS || table_end + len > end) {
+            free(payload);
+            return -1;
+        }
+        end -= len;
+        memcpy(payload + end, data, len);
+        uint8_t *d = payload + 1 + QFS_TAIL_SLICE_SIZE * count++;
+        d[0] = dir_index;
+        d[1] = end & 0xFF;
+        d[2] = (end >> 8) & 0xFF;
+        d[3] = len & 0xFF;
+        d[4] = (len >> 8) & 0xFF;
+    }
+    payload[0] = (uint8_t)count;
+
+    block[0] = (uint8_t)count;
+    memcpy(block + 1, payload, dpb);
+    block[bpb - 2] = 0xFF;
+    block[bpb - 1] = 0xFF;
+    qfs_block_seal(sb, block);
+    free(payload);
+    return 0;
+}
+
+// Start an empty tail block in 'block' (bytes_per_block bytes).
+static inline void qfs_tail_init(const superblock_t *sb, uint8_t *block) {
+    memset(block, 0, sb->bytes_per_block);
+    block[sb->bytes_per_block - 2] = 0xFF;
+    block[sb->bytes_per_block - 1] = 0xFF;
+}
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * CSC 310 - Operating Systems Final Project
+ * qfs_replay.c
+ *
+ * Usage:
+ *   ./qfs_replay [-t] [-m <MB>] [-d] [-c] [-s] [-p] <trace file> <scratch image>
+ *
+ * Replays an operation trace recorded with QFS_TRACE (see qfs_trace.h)
+ * against a freshly formatted image, so that the workload that shaped a
+ * production image can be rerun and measured at will.
+ *
+ * The scratch image is created (or truncated) at -m megabytes, default 4,
+ * and formatted with mkfs_qfs using the -d/-c/-s/-p options given. Every
+ * traced write, read, delete and list is then performed by running the
+ * real tool (write_file, read_file, delete_file, list_information) from
+ * the directory qfs_replay was started from, so the allocator and I/O paths
+ * under test are exactly the ones in use. Written files get deterministic
+ * pseudo-random contents of the recorded size, so two replays of one trace
+ * produce identical images.
+ *
+ * By default operations run back to back at full speed; with -t each one
+ * starts at its recorded offset from the beginning of the trace. Traced
+ * operations are replayed one at a time in start order.
+ *
+ * The report gives per-operation latency (mean, percentiles, maximum) as
+ * seen by the replaying process, the operations whose outcome differs from
+ * the recorded one, and the resulting fragmentation: how many pieces files
+ * are split into and how scattered the free space is.
+ */
+
+#define _GNU_SOURCE               // SEEK_DATA (see qfs_io.h), mkdtemp()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "qfs.h"
+#include "qfs_io.h"
+#include "qfs_pack.h"
+#include "qfs_trace.h"
+
+#define REPLAY_OPS 6              // QFS_TRACE_* 1..5, index 0 unused
+
+static const char *op_names[REPLAY_OPS] = { "?", "write", "read", "delete", "list", "stat" };
+
+static char tool_dir[4096];       // where the tools live, "" to search PATH
+
+typedef struct op_stats {
+    uint32_t  count;
+    uint32_t  failed;             // nonzero exit status
+    uint32_t  differ;             // outcome (success/failure) unlike the trace
+    uint64_t  bytes;
+    uint64_t *lat_ns;
+} op_stats_t;
+
+static int cmp_rec(const void *a, const void *b) {
+    const qfs_trace_rec_t *x = a, *y = b;
+    return (x->start_ns > y->start_ns) - (x->start_ns < y->start_ns);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int run_tool(const char *tool, char *args[]) {
+    // Run a QFS tool with its output discarded; returns its exit status,
+    // or 127 if it could not be started.
+    char path[4096 + 64];
+    if (tool_dir[0])
+        snprintf(path, sizeof(path), "%s/%s", tool_dir, tool);
+    else
+        snprintf(path, sizeof(path), "%s", tool);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return 127;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        args[0] = path;
+        if (tool_dir[0])
+            execv(path, args);
+        else
+            execvp(path, args);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return 127;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+static int make_file(const char *path, const char *name, uint32_t size) {
+    // Deterministic contents for a traced write: xorshift64 seeded from
+    // the file's name and size
+    uint64_t x = 0xcbf29ce484222325ull ^ size;
+    for (const char *p = name; *p; p++)
+        x = (x ^ (uint8_t)*p) * 0x100000001b3ull;
+    if (x == 0)
+        x = 1;
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+    uint64_t buf[1024];
+    for (uint32_t done = 0; done < size; ) {
+        for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = x;
+        }
+        uint32_t n = size - done > sizeof(buf) ? sizeof(buf) : size - done;
+        if (fwrite(buf, 1, n, f) != n) {
+            fclose(f);
+            return -1;
+        }
+        done += n;
+    }
+    return fclose(f);
+}
+
+static int format_image(const char *image, long megabytes, char *mkfs_opts[], int nopts) {
+    int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)megabytes << 20) != 0) {
+        perror(image);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    char *args[8];
+    int n = 0;
+    args[n++] = NULL;             // filled in by run_tool()
+    for (int i = 0; i < nopts; i++)
+        args[n++] = mkfs_opts[i];
+    args[n++] = (char *)image;
+    args[n++] = "Replay";
+    args[n] = NULL;
+    return run_tool("mkfs_qfs", args) == 0 ? 0 : -1;
+}
+
+static void report_latency(op_stats_t *st) {
+    printf("%-7s %7s %7s %7s %12s %10s %10s %10s %10s %10s\n", "op", "count", "failed",
+           "differ", "bytes", "mean us", "p50 us", "p95 us", "p99 us", "max us");
+    for (int op = 1; op < REPLAY_OPS; op++) {
+        op_stats_t *s = &st[op];
+        if (s->count == 0)
+            continue;
+        qsort(s->lat_ns, s->count, sizeof(uint64_t), cmp_u64);
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < s->count; i++)
+            sum += s->lat_ns[i];
+        printf("%-7s %7u %7u %7u %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               op_names[op], s->count, s->failed, s->differ, (unsigned long long)s->bytes,
+               sum / 1e3 / s->count,
+               s->lat_ns[(s->count - 1) * 50 / 100] / 1e3,
+               s->lat_ns[(s->count - 1) * 95 / 100] / 1e3,
+               s->lat_ns[(s->count - 1) * 99 / 100] / 1e3,
+               s->lat_ns[s->count - 1] / 1e3);
+    }
+}
+
+static int report_fragmentation(const char *image) {
+    FILE *fp = fopen(image, "rb");
+    if (!fp) {
+        perror(image);
+        return -1;
+    }
+    superblock_t sb;
+    if (fread(&sb, sizeof(sb), 1, fp) != 1 || sb.fs_type != 0x51) {
+        fprintf(stderr, "Not a valid QFS filesystem.\n");
+        fclose(fp);
+        return -1;
+    }
+
+    uint32_t bpb = sb.bytes_per_block;
+    long data_start = sizeof(superblock_t) + (long)sizeof(direntry_t) * sb.total_direntries;
+    direntry_t *dir = calloc(sb.total_direntries ? sb.total_direntries : 1, sizeof(direntry_t));
+    uint8_t *block = malloc(bpb);
+    if (!dir || !block ||
+        fread(dir, sizeof(direntry_t), sb.total_direntries, fp) != sb.total_direntries) {
+        fprintf(stderr, "Error reading directory.\n");
+        free(dir);
+        free(block);
+        fclose(fp);
+        return -1;
+    }
+
+    // Pieces per file: runs of consecutive blocks along each chain
+    uint32_t files = 0, inline_files = 0, fragmented = 0, max_pieces = 0;
+    uint64_t pieces_total = 0, chain_blocks = 0;
+    for (int i = 0; i < sb.total_direntries; i++) {
+        const direntry_t *d = &dir[i];
+        if (d->filename[0] == '\0' || d->filename[0] == QFS_DIRENT_CONT)
+            continue;
+        files++;
+        if (d->permissions & QFS_PERM_INLINE) {
+            inline_files++;
+            continue;
+        }
+
+        uint32_t pieces = 0, n = 0;
+        uint32_t prev = 0;
+        uint16_t b = d->starting_block;
+        while (b != 0xFFFF && b < sb.total_blocks && n < sb.total_blocks) {
+            if (n == 0 || b != prev + 1)
+                pieces++;
+            prev = b;
+            n++;
+            fseek(fp, data_start + (long)b * bpb, SEEK_SET);
+            if (fread(block, bpb, 1, fp) != 1)
+                break;
+            b = block[bpb - 2] | (block[bpb - 1] << 8);
+        }
+        chain_blocks += n;
+        pieces_total += pieces;
+        if (pieces > 1)
+            fragmented++;
+        if (pieces > max_pieces)
+            max_pieces = pieces;
+    }
+
+    // Free space: extents of consecutive free blocks
+    int fd = fileno(fp);
+    qfs_holes_t holes;
+    qfs_holes_init(&holes, fd);
+    uint32_t free_blocks = 0, extents = 0, largest = 0, run = 0;
+    for (uint32_t b = 0; b < sb.total_blocks; b++) {
+        off_t offset = data_start + (off_t)b * bpb;
+        uint8_t busy = 0;
+        if (!qfs_io_in_hole(&holes, offset) && pread(fd, &busy, 1, offset) != 1)
+            busy = 0xFF;
+        if (busy == 0x00) {
+            free_blocks++;
+            if (run++ == 0)
+                extents++;
+            if (run > largest)
+                largest = run;
+        } else {
+            run = 0;
+        }
+    }
+
+    uint32_t chained = files - inline_files;
+    printf("Files: %u (%u inline), %llu block(s) on their chains\n",
+           files, inline_files, (unsigned long long)chain_blocks);
+    printf("Pieces per file: mean %.2f, max %u; %u file(s) fragmented (%.1f%%)\n",
+           chained ? (double)pieces_total / chained : 0.0, max_pieces, fragmented,
+           chained ? 100.0 * fragmented / chained : 0.0);
+    printf("Free space: %u block(s) in %u extent(s), largest %u\n",
+           free_blocks, extents, largest);
+
+    free(dir);
+    free(block);
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    int timed = 0;
+    long megabytes = 4;
+    char *mkfs_opts[4];
+    int nopts = 0;
+
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *opt = argv[argi];
+        if (strcmp(opt, "-t") == 0) {
+            timed = 1;
+        } else if (strcmp(opt, "-m") == 0 && argi + 1 < argc) {
+            megabytes = strtol(argv[++argi], NULL, 10);
+        } else if ((strcmp(opt, "-d") == 0 || strcmp(opt, "-c") == 0 ||
+                    strcmp(opt, "-s") == 0 || strcmp(opt, "-p") == 0) && nopts < 4) {
+            mkfs_opts[nopts++] = argv[argi];
+        } else {
+            argc = 0;
+            break;
+        }
+    }
+
+    if (argc - argi != 2 || megabytes <= 0) {
+        fprintf(stderr, "Usage: %s [-t] [-m <MB>] [-d] [-c] [-s] [-p] <trace file> <scratch image>\n",
+                argc ? argv[0] : "qfs_replay");
+        return 1;
+    }
+    const char *trace_path = argv[argi];
+    const char *image = argv[argi + 1];
+
+    // The tools are run from qfs_replay's own directory (or found on PATH)
+    const char *slash = strrchr(argv[0], '/');
+    if (slash)
+        snprintf(tool_dir, sizeof(tool_dir), "%.*s", (int)(slash - argv[0]), argv[0]);
+    if (slash == argv[0])
+        strcpy(tool_dir, "/");
+
+    // The replay itself must neither be traced nor go to a daemon
+    unsetenv(QFS_TRACE_ENV);
+    unsetenv("QFSD_SOCKET");
+
+    FILE *tf = fopen(trace_path, "rb");
+    if (!tf) {
+        perror(trace_path);
+        return 2;
+    }
+    fseek(tf, 0, SEEK_END);
+    long trace_len = ftell(tf);
+    fseek(tf, 0, SEEK_SET);
+    size_t nrec = trace_len > 0 ? (size_t)trace_len / sizeof(qfs_trace_rec_t) : 0;
+    qfs_trace_rec_t *recs = malloc(sizeof(qfs_trace_rec_t) * (nrec ? nrec : 1));
+    if (!recs || fread(recs, sizeof(qfs_trace_rec_t), nrec, tf) != nrec) {
+        fprintf(stderr, "Error reading trace.\n");
+        free(recs);
+        fclose(tf);
+        return 3;
+    }
+    fclose(tf);
+
+    // Processes append as they finish; replay in the order operations began
+    qsort(recs, nrec, sizeof(qfs_trace_rec_t), cmp_rec);
+
+    if (format_image(image, megabytes, mkfs_opts, nopts) != 0) {
+        fprintf(stderr, "Could not format %s.\n", image);
+        free(recs);
+        return 4;
+    }
+
+    char scratch[] = "/tmp/qfs_replay.XXXXXX";
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        free(recs);
+        return 5;
+    }
+
+    op_stats_t stats[REPLAY_OPS];
+    memset(stats, 0, sizeof(stats));
+    for (int op = 0; op < REPLAY_OPS; op++) {
+        stats[op].lat_ns = malloc(sizeof(uint64_t) * (nrec ? nrec : 1));
+        if (!stats[op].lat_ns) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            return 7;
+        }
+    }
+
+    uint32_t skipped = 0;
+    uint64_t replay_start = now_ns();
+    for (size_t i = 0; i < nrec; i++) {
+        qfs_trace_rec_t *rec = &recs[i];
+        char name[QFS_TRACE_NAME + 1];
+        memcpy(name, rec->name, QFS_TRACE_NAME);
+        name[QFS_TRACE_NAME] = '\0';
+
+        int op = rec->op;
+        int has_name = name[0] != '\0' && strchr(name, '/') == NULL;
+        if (op <= 0 || op >= REPLAY_OPS || op == QFS_TRACE_STAT ||
+            (op != QFS_TRACE_LIST && !has_name)) {
+            skipped++;
+            continue;
+        }
+
+        char path[sizeof(scratch) + QFS_TRACE_NAME + 2];
+        snprintf(path, sizeof(path), "%s/%s", scratch, name);
+        if (op == QFS_TRACE_WRITE && make_file(path, name, rec->size) != 0) {
+            fprintf(stderr, "Could not create %s.\n", path);
+            skipped++;
+            continue;
+        }
+
+        if (timed) {
+            uint64_t due = replay_start + (rec->start_ns - recs[0].start_ns);
+            uint64_t now = now_ns();
+            if (due > now) {
+                struct timespec ts = { (time_t)((due - now) / 1000000000ull),
+                                       (long)((due - now) % 1000000000ull) };
+                while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+                    ;
+            }
+        }
+
+        char *args[5] = { NULL, (char *)image, NULL, NULL, NULL };
+        const char *tool;
+        switch (op) {
+        case QFS_TRACE_WRITE:  tool = "write_file";  args[2] = path; break;
+        case QFS_TRACE_READ:   tool = "read_file";   args[2] = name; args[3] = "/dev/null"; break;
+        case QFS_TRACE_DELETE: tool = "delete_file"; args[2] = name; break;
+        default:               tool = "list_information"; break;
+        }
+
+        uint64_t t0 = now_ns();
+        int status = run_tool(tool, args);
+        uint64_t t1 = now_ns();
+        if (op == QFS_TRACE_WRITE)
+            unlink(path);
+
+        op_stats_t *s = &stats[op];
+        s->lat_ns[s->count++] = t1 - t0;
+        s->bytes += rec->size;
+        if (status != 0)
+            s->failed++;
+        if ((status != 0) != (rec->status != 0))
+            s->differ++;
+        if (status == 127) {
+            fprintf(stderr, "Could not run %s.\n", tool);
+            break;
+        }
+    }
+    uint64_t replay_ns = now_ns() - replay_start;
+    rmdir(scratch);
+
+    uint32_t replayed = 0;
+    for (int op = 1; op < REPLAY_OPS; op++)
+        replayed += stats[op].count;
+    printf("Replayed %u of %zu operation(s) in %.3f s (%s)", replayed, nrec, replay_ns / 1e9,
+           timed ? "recorded timing" : "full speed");
+    if (skipped)
+        printf(", %u skipped", skipped);
+    printf("\n\n");
+    report_latency(stats);
+    printf("\n");
+    int rc = report_fragmentation(image) == 0 ? 0 : 6;
+
+    for (int op = 0; op < REPLAY_OPS; op++)
+        free(stats[op].lat_ns);
+    free(recs);
+    return rc;
+}
@@ -0,0 +1,244 @@
+/*
+ * CSC 310 - Operating Systems Final Project
+ * qfs_snapshot.c
+ *
+ * Usage:
+ *   ./qfs_snapshot <disk image file> <delta file> [<since generation>]
+ *
+ * Writes a delta of a QFS image holding everything that changed after the
+ * given generation (default 0, i.e. the whole image), to be applied to a
+ * replica with qfs_sync. A delta file of "-" goes to standard output, so
+ * deltas can be piped straight to another host:
+ *
+ *   qfs_snapshot disk.img - 41 | ssh backup qfs_sync replica.img -
+ *
+ * The first snapshot of an image starts tracking it: a generation map is
+ * created next to it (see qfs_gen.h), and from then on write_file,
+ * delete_file, qfs_tar -x and qfsd stamp every block they change with a new
+ * generation. The generation reached is printed; it is the <since> value
+ * for the next delta. Blocks that are holes in a sparse image are sent as
+ * hole records without contents.
+ *
+ * Take snapshots while no tool is writing to the image. A delta that raced
+ * a write fails its check in qfs_sync and is simply taken again.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+
+// Delta output with a running checksum for the trailer.
+typedef struct delta_out {
+    FILE    *fp;
+    uint32_t crc;
+    uint64_t bytes;
+    int      error;
+} delta_out_t;
+
+static void emit(delta_out_t *out, const void *buf, size_t len) {
+    if (out->error || len == 0)
+        return;
+    if (fwrite(buf, len, 1, out->fp) != 1) {
+        out->error = 1;
+        return;
+    }
+    out->crc = qfs_crc32c(out->crc, buf, len);
+    out->bytes += len;
+}
+
+static uint64_t new_lineage(void) {
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &id, sizeof(id)) != sizeof(id))
+            id = 0;
+        close(fd);
+    }
+    if (id == 0)
+        id = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+    return id;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s <disk image file> <delta file> [<since generation>]\n", argv[0]);
+        return 1;
+    }
+    const char *image = argv[1];
+    const char *delta = argv[2];
+    char *end = NULL;
+    unsigned long since = argc == 4 ? strtoul(argv[3], &end, 10) : 0;
+    if (argc == 4 && (*argv[3] == '\0' || *end != '\0' || since > UINT32_MAX)) {
+        fprintf(stderr, "Invalid generation: %s\n", argv[3]);
+        return 1;
+    }
+
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 2;
+    }
+    struct stat st;
+    superblock_t sb;
+    if (fstat(fd, &st) != 0 ||
+        qfs_io_full(fd, 0, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        fprintf(stderr, "Error reading superblock.\n");
+        close(fd);
+        return 3;
+    }
+    if (sb.fs_type != 0x51) {
+        fprintf(stderr, "Not a valid QFS filesystem.\n");
+        close(fd);
+        return 4;
+    }
+
+    // ---------------------------------------------------
+    // Generation map, created on the first snapshot
+    // ---------------------------------------------------
+    qfs_gen_header_t hdr;
+    uint32_t *gens;
+    if (qfs_gen_load(image, &sb, &hdr, &gens) != 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Generation map of \"%s\" does not match the image.\n", image);
+            close(fd);
+            return 5;
+        }
+        memcpy(hdr.magic, QFS_GEN_MAGIC, 4);
+        hdr.total_blocks = sb.total_blocks;
+        hdr.bytes_per_block = sb.bytes_per_block;
+        hdr.generation = 1;
+        hdr.lineage = new_lineage();
+        gens = malloc(sizeof(uint32_t) * (sb.total_blocks ? sb.total_blocks : 1));
+        if (!gens) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            close(fd);
+            return 7;
+        }
+        for (uint32_t b = 0; b < sb.total_blocks; b++)
+            gens[b] = 1;
+        if (qfs_gen_save(image, &hdr, gens) != 0) {
+            perror("generation map");
+            free(gens);
+            close(fd);
+            return 6;
+        }
+        fprintf(stderr, "Started tracking \"%s\" at generation 1.\n", image);
+    }
+    if (since > hdr.generation) {
+        fprintf(stderr, "Generation %lu is newer than the image (%u).\n", since, hdr.generation);
+        free(gens);
+        close(fd);
+        return 1;
+    }
+
+    // ---------------------------------------------------
+    // Header: the image checksum is taken up front
+    // ---------------------------------------------------
+    uint32_t bpb = sb.bytes_per_block;
+    uint32_t meta_len = sizeof(superblock_t) + sizeof(direntry_t) * sb.total_direntries;
+    uint8_t *meta = malloc(meta_len);
+    uint8_t *block = malloc(bpb);
+    if (!meta || !block) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(meta);
+        free(block);
+        free(gens);
+        close(fd);
+        return 7;
+    }
+
+    qfs_delta_header_t dh;
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.magic, QFS_DELTA_MAGIC, 4);
+    dh.total_blocks = sb.total_blocks;
+    dh.bytes_per_block = sb.bytes_per_block;
+    dh.lineage = hdr.lineage;
+    dh.base = (uint32_t)since;
+    dh.generation = hdr.generation;
+    dh.image_size = (uint64_t)st.st_size;
+    dh.meta_len = meta_len;
+    for (uint32_t b = 0; b < sb.total_blocks; b++)
+        dh.block_count += gens[b] > since;
+
+    int rc = 0;
+    uint32_t image_crc = 0;
+    if (qfs_gen_image_crc(fd, dh.image_size, &image_crc) != 0 ||
+        qfs_io_full(fd, 0, meta, meta_len, 0) != (ssize_t)meta_len) {
+        fprintf(stderr, "Error reading disk image.\n");
+        rc = 8;
+    }
+    dh.image_crc = image_crc;
+
+    delta_out_t out;
+    memset(&out, 0, sizeof(out));
+    if (rc == 0) {
+        out.fp = strcmp(delta, "-") == 0 ? stdout : fopen(delta, "wb");
+        if (!out.fp) {
+            perror("fopen(delta file)");
+            rc = 6;
+        }
+    }
+
+    // ---------------------------------------------------
+    // Metadata, changed blocks, trailer
+    // ---------------------------------------------------
+    uint32_t holes_sent = 0;
+    if (rc == 0) {
+        emit(&out, &dh, sizeof(dh));
+        emit(&out, meta, meta_len);
+
+        qfs_holes_t holes;
+        qfs_holes_init(&holes, fd);
+        for (uint32_t b = 0; b < sb.total_blocks && !out.error && rc == 0; b++) {
+            if (gens[b] <= since)
+                continue;
+            off_t offset = (off_t)meta_len + (off_t)b * bpb;
+            qfs_delta_rec_t rec = { (uint16_t)b, QFS_DELTA_DATA };
+            if (qfs_io_in_hole(&holes, offset) && qfs_io_in_hole(&holes, offset + bpb - 1)) {
+                rec.kind = QFS_DELTA_HOLE;
+                holes_sent++;
+                emit(&out, &rec, sizeof(rec));
+                continue;
+            }
+            if (qfs_io_full(fd, 0, block, bpb, offset) != (ssize_t)bpb) {
+                fprintf(stderr, "Error reading block %u.\n", b);
+                rc = 8;
+                break;
+            }
+            emit(&out, &rec, sizeof(rec));
+            emit(&out, block, bpb);
+        }
+
+        uint32_t trailer = out.crc;
+        emit(&out, &trailer, sizeof(trailer));
+        if (out.fp == stdout ? fflush(stdout) != 0 : fclose(out.fp) != 0)
+            out.error = 1;
+        if (out.error && rc == 0) {
+            fprintf(stderr, "Error writing delta file.\n");
+            rc = 9;
+        }
+    }
+
+    if (rc == 0)
+        fprintf(stderr, "Delta of \"%s\" from generation %lu to %u: %u of %u block(s) "
+                        "(%u hole(s)), %llu bytes.\n",
+                image, since, hdr.generation, dh.block_count, sb.total_blocks, holes_sent,
+                (unsigned long long)out.bytes);
+
+    free(meta);
+    free(block);
+    free(gens);
+    close(fd);
+    return rc;
+}
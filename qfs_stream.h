@@ -0,0 +1,337 @@
+/*
+**
+** Streaming file transfer between QFS images and pipes.
+**
+** qfs_stream_write() stores a byte stream of unknown length as a new block
+** chain. Blocks are allocated from a qfs_alloc_t cursor as input arrives and
+** written in runs of up to QFS_STREAM_BATCH blocks; the last block of each
+** batch is held back until the next batch (or the end of input) decides its
+** next pointer. The caller writes the directory entry once the size is
+** known. The allocator only moves forward, so a tool importing many files
+** scans the data region for free blocks once in total.
+**
+** qfs_stream_read() writes a file's contents to a stdio stream, whatever its
+** layout: inline (from the directory), packed tail, checksummed or plain.
+**
+** Neither needs a seekable input or output, so images can be filled from and
+** drained into pipes (write_file -, read_file ... -, qfs_tar).
+**
+** Usage: #include "qfs_stream.h"
+**
+*/
+
+#ifndef QFS_STREAM_H
+#define QFS_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+#include "qfs_kernels.h"
+#include "qfs_pack.h"
+
+#define QFS_STREAM_BATCH   64     // blocks read and written per batch
+#define QFS_ALLOC_WINDOW   256    // busy bytes examined per pread()
+#define QFS_STREAM_TO_EOF  UINT64_MAX
+
+#define QFS_STREAM_EIO     -1     // image read/write error
+#define QFS_STREAM_ENOSPC  -2     // no free blocks left
+#define QFS_STREAM_ENOMEM  -3
+#define QFS_STREAM_EINPUT  -4     // input ended before the expected length
+#define QFS_STREAM_ECRC    -5     // block failed its CRC32C check
+#define QFS_STREAM_ETAIL   -6     // packed tail slice missing or the wrong size
+#define QFS_STREAM_EOUTPUT -7     // writing to the output stream failed
+
+// Forward-only free block allocator over the data region.
+typedef struct qfs_alloc {
+    int                 fd;
+    const superblock_t *sb;
+    qfs_kernels_t       kern;
+    qfs_gen_t          *gen;          // stamps written blocks, or NULL
+    long                data_start;
+    qfs_holes_t         holes;
+    uint32_t            cursor;       // next block to consider
+    uint32_t            win_first;    // first block of the window
+    uint32_t            win_count;    // blocks in the window
+    uint8_t            *window;       // their contents
+} qfs_alloc_t;
+
+static inline int qfs_alloc_init(qfs_alloc_t *a, int fd, const superblock_t *sb) {
+    memset(a, 0, sizeof(*a));
+    a->fd = fd;
+    a->sb = sb;
+    qfs_kernels_init(&a->kern, sb);
+    a->data_start = sizeof(superblock_t) + (long)sizeof(direntry_t) * sb->total_direntries;
+    qfs_holes_init(&a->holes, fd);
+    a->window = malloc((size_t)sb->bytes_per_block * QFS_ALLOC_WINDOW);
+    return a->window ? 0 : -1;
+}
+
+static inline void qfs_alloc_destroy(qfs_alloc_t *a) {
+    free(a->window);
+    a->window = NULL;
+}
+
+// Next free block at or after the cursor: 0 and *block, QFS_STREAM_ENOSPC
+// or QFS_STREAM_EIO.
+static inline int qfs_alloc_next(qfs_alloc_t *a, uint16_t *block) {
+    uint32_t bpb = a->sb->bytes_per_block;
+    while (a->cursor < a->sb->total_blocks) {
+        uint32_t b = a->cursor++;
+        off_t offset = a->data_start + (off_t)b * bpb;
+        if (qfs_io_in_hole(&a->holes, offset)) {
+            *block = (uint16_t)b;
+            return 0;
+        }
+
+        if (b < a->win_first || b >= a->win_first + a->win_count) {
+            uint32_t n = a->sb->total_blocks - b;
+            if (n > QFS_ALLOC_WINDOW)
+                n = QFS_ALLOC_WINDOW;
+            ssize_t got = qfs_io_full(a->fd, 0, a->window, (size_t)n * bpb, offset);
+            if (got < (ssize_t)bpb)
+                return QFS_STREAM_EIO;
+            a->win_first = b;
+            a->win_count = got / bpb;
+        }
+        if (a->window[(size_t)(b - a->win_first) * bpb] == 0x00) {
+            *block = (uint16_t)b;
+            return 0;
+        }
+    }
+    return QFS_STREAM_ENOSPC;
+}
+
+// Fill the iovecs from a pipe or file at its current position. Returns the
+// bytes read, short only at end of input, or -1 on a read error.
+static inline ssize_t qfs_stream_readv(int fd, struct iovec *iov, int n) {
+    size_t total = 0;
+    while (n > 0) {
+        ssize_t r = readv(fd, iov, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        total += r;
+        while (n > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return total;
+}
+
+// Write frames[0..n) to blocks[0..n), one pwrite() per consecutive run.
+static inline int qfs_stream_put(qfs_alloc_t *a, const uint8_t *frames,
+                                 const uint16_t *blocks, uint32_t n) {
+    uint32_t bpb = a->sb->bytes_per_block;
+    if (a->gen)
+        qfs_gen_mark(a->gen, blocks, n);
+    for (uint32_t i = 0; i < n; ) {
+        uint32_t run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run)
+            run++;
+        size_t len = (size_t)run * bpb;
+        if (qfs_io_full(a->fd, 1, (void *)(frames + (size_t)i * bpb), len,
+                        a->data_start + (off_t)blocks[i] * bpb) != (ssize_t)len)
+            return QFS_STREAM_EIO;
+        i += run;
+    }
+    return 0;
+}
+
+// Store up to 'limit' bytes from in_fd (QFS_STREAM_TO_EOF: until end of
+// input) as a new chain. On success returns 0 with the chain's first block,
+// block count and byte size; an empty input still gets one block, as with
+// write_file. On failure the blocks written so far are released again and
+// the superblock is untouched; the caller updates it on success.
+static inline int qfs_stream_write(qfs_alloc_t *a, int in_fd, uint64_t limit,
+                                   uint16_t *start, uint32_t *blocks_used,
+                                   uint32_t *size) {
+    const superblock_t *sb = a->sb;
+    const qfs_kernels_t *kern = &a->kern;
+    uint32_t bpb = kern->bpb;
+    uint32_t data_per_block = kern->dpb;
+
+    // Batch frames, plus the held-back last frame of the previous batch
+    uint8_t *frames = malloc((size_t)bpb * (QFS_STREAM_BATCH + 1));
+    uint16_t *chain = malloc(sizeof(uint16_t) * (sb->total_blocks ? sb->total_blocks : 1));
+    if (!frames || !chain) {
+        free(frames);
+        free(chain);
+        return QFS_STREAM_ENOMEM;
+    }
+    uint8_t *held = frames + (size_t)bpb * QFS_STREAM_BATCH;
+
+    uint32_t nchain = 0;
+    uint64_t total = 0;
+    int rc = 0;
+    int eof = 0;
+
+    while (!eof) {
+        // Read the next batch straight into the payload areas
+        struct iovec iov[QFS_STREAM_BATCH];
+        uint32_t n = 0;
+        uint64_t want = 0;
+        for (; n < QFS_STREAM_BATCH && total + want < limit; n++) {
+            uint64_t left = limit - total - want;
+            iov[n].iov_base = frames + (size_t)n * bpb + 1;
+            iov[n].iov_len = left < data_per_block ? left : data_per_block;
+            want += iov[n].iov_len;
+        }
+        ssize_t got = n ? qfs_stream_readv(in_fd, iov, n) : 0;
+        if (got < 0) {
+            rc = QFS_STREAM_EINPUT;
+            break;
+        }
+        if ((uint64_t)got < want) {
+            if (limit != QFS_STREAM_TO_EOF) {
+                rc = QFS_STREAM_EINPUT;
+                break;
+            }
+            eof = 1;
+        }
+        if (total + got >= limit)
+            eof = 1;
+
+        uint32_t used = (got + data_per_block - 1) / data_per_block;
+        if (used == 0 && nchain == 0)
+            used = 1;                       // empty file: one empty block
+        if (nchain + used > sb->available_blocks) {
+            rc = QFS_STREAM_ENOSPC;
+            break;
+        }
+
+        uint16_t *blocks = chain + nchain;
+        for (uint32_t k = 0; k < used && rc == 0; k++)
+            rc = qfs_alloc_next(a, &blocks[k]);
+        if (rc != 0)
+            break;
+
+        // The held frame now knows its successor
+        if (nchain > 0 && used > 0) {
+            kern->link(kern, held, blocks[0]);
+            if ((rc = qfs_stream_put(a, held, &chain[nchain - 1], 1)) != 0)
+                break;
+        }
+
+        // The last frame's next pointer is set once it is known
+        uint16_t next[QFS_STREAM_BATCH];
+        for (uint32_t k = 0; k < used; k++)
+            next[k] = (k + 1 < used) ? blocks[k + 1] : 0xFFFF;
+        kern->frame(kern, frames, used, (size_t)got, next);
+        nchain += used;
+        total += got;
+
+        // Hold back the last frame unless this was the end of the input
+        if (used > 0) {
+            memcpy(held, frames + (size_t)(used - 1) * bpb, bpb);
+            if ((rc = qfs_stream_put(a, frames, blocks, used - 1)) != 0)
+                break;
+        }
+    }
+
+    if (rc == 0 && total > UINT32_MAX)
+        rc = QFS_STREAM_ENOSPC;
+    if (rc == 0) {
+        kern->link(kern, held, 0xFFFF);
+        rc = qfs_stream_put(a, held, &chain[nchain - 1], 1);
+    }
+
+    if (rc != 0) {
+        // Give back the blocks written so far
+        for (uint32_t i = 0; i < nchain; i++) {
+            uint8_t zero = 0x00;
+            qfs_io_full(a->fd, 1, &zero, 1, a->data_start + (off_t)chain[i] * bpb);
+        }
+    } else {
+        *start = chain[0];
+        *blocks_used = nchain;
+        *size = (uint32_t)total;
+    }
+    free(frames);
+    free(chain);
+    return rc;
+}
+
+// Copy the file described by dir[dir_index] to 'out'. The directory array
+// holds every entry, so inline files can be read from their continuation
+// records. Returns 0 or a QFS_STREAM_* error; for EIO, ECRC and ETAIL on a
+// block chain the block at fault is stored in *bad_block (if not NULL).
+static inline int qfs_stream_read(qfs_io_t *io, const superblock_t *sb, const direntry_t *dir,
+                                  int dir_index, FILE *out, uint16_t *bad_block) {
+    const direntry_t *d = &dir[dir_index];
+    uint32_t remaining = d->file_size;
+
+    if (d->permissions & QFS_PERM_INLINE) {
+        for (uint32_t k = 0; remaining > 0; k++) {
+            if (dir_index + 1 + k >= sb->total_direntries)
+                return QFS_STREAM_EIO;
+            const uint8_t *record = (const uint8_t *)&dir[dir_index + 1 + k];
+            uint32_t chunk = remaining > QFS_INLINE_PER_SLOT ? QFS_INLINE_PER_SLOT : remaining;
+            if (record[0] != QFS_DIRENT_CONT)
+                return QFS_STREAM_EIO;
+            if (fwrite(record + 1, chunk, 1, out) != 1)
+                return QFS_STREAM_EOUTPUT;
+            remaining -= chunk;
+        }
+        return 0;
+    }
+
+    uint32_t data_per_block = qfs_data_per_block(sb);
+    uint32_t expected = (remaining + data_per_block - 1) / data_per_block;
+    qfs_chain_t chain;
+    if (qfs_chain_open(&chain, io, sb, d->starting_block, expected ? expected : 1) != 0)
+        return QFS_STREAM_ENOMEM;
+
+    int rc = 0;
+    uint16_t block = d->starting_block;
+    while (remaining > 0) {
+        const uint8_t *buffer = qfs_chain_next(&chain, &block);
+        if (!buffer) {
+            block = (uint16_t)chain.cur;
+            rc = QFS_STREAM_EIO;
+            break;
+        }
+        if (!chain.kern.verify(&chain.kern, buffer)) {
+            rc = QFS_STREAM_ECRC;
+            break;
+        }
+
+        // A packed file's last partial block is its slice of a tail block
+        const uint8_t *data = buffer + 1;
+        uint32_t chunk = remaining > data_per_block ? data_per_block : remaining;
+        if ((d->permissions & QFS_PERM_TAIL) && remaining < data_per_block) {
+            uint16_t len;
+            if (qfs_tail_find(sb, buffer, (uint8_t)dir_index, &data, &len) != 0 ||
+                len != remaining) {
+                rc = QFS_STREAM_ETAIL;
+                break;
+            }
+        }
+        if (fwrite(data, chunk, 1, out) != 1) {
+            rc = QFS_STREAM_EOUTPUT;
+            break;
+        }
+        remaining -= chunk;
+    }
+    qfs_chain_close(&chain);
+    if (rc != 0 && bad_block)
+        *bad_block = block;
+    return rc;
+}
+
+#endif
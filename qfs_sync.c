@@ -0,0 +1,260 @@
+/*
+ * CSC 310 - Operating Systems Final Project
+ * qfs_sync.c
+ *
+ * Usage:
+ *   ./qfs_sync <replica image> <delta file>
+ *
+ * Applies a delta written by qfs_snapshot to a replica of a QFS image. A
+ * delta file of "-" is read from standard input.
+ *
+ * The whole delta is read and its trailing CRC32C checked before anything
+ * is written, so a truncated or damaged delta never touches the replica. A
+ * full delta (since generation 0) creates or overwrites the replica. Any
+ * other delta must belong to the same image as the replica and start at or
+ * before the generation the replica has reached; the generation map kept
+ * next to the replica (see qfs_gen.h) records both.
+ *
+ * After the blocks are written the replica's CRC32C is compared with the
+ * source image's. On a mismatch the replica keeps its previous generation
+ * and has to be seeded again from a full delta.
+ */
+
+#define _GNU_SOURCE               // fallocate() (see qfs_io.h)
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+
+static uint8_t *read_delta(const char *path, size_t *len) {
+    // The whole delta in memory, or NULL with errno set
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!in)
+        return NULL;
+
+    size_t cap = 1 << 20, n = 0;
+    uint8_t *buf = malloc(cap);
+    while (buf) {
+        n += fread(buf + n, 1, cap - n, in);
+        if (n < cap)
+            break;
+        uint8_t *grown = realloc(buf, cap * 2);
+        if (!grown) {
+            free(buf);
+            buf = NULL;
+            errno = ENOMEM;
+            break;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+    if (buf && ferror(in)) {
+        free(buf);
+        buf = NULL;
+        errno = EIO;
+    }
+    if (in != stdin)
+        fclose(in);
+    *len = n;
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <replica image> <delta file>\n", argv[0]);
+        return 1;
+    }
+    const char *replica = argv[1];
+
+    // ---------------------------------------------------
+    // Read and check the delta
+    // ---------------------------------------------------
+    size_t len;
+    uint8_t *delta = read_delta(argv[2], &len);
+    if (!delta) {
+        perror(argv[2]);
+        return 2;
+    }
+
+    qfs_delta_header_t dh;
+    uint32_t trailer;
+    int valid = len >= sizeof(dh) + sizeof(trailer);
+    if (valid) {
+        memcpy(&dh, delta, sizeof(dh));
+        memcpy(&trailer, delta + len - sizeof(trailer), sizeof(trailer));
+        valid = memcmp(dh.magic, QFS_DELTA_MAGIC, 4) == 0 &&
+                trailer == qfs_crc32c(0, delta, len - sizeof(trailer)) &&
+                dh.meta_len >= sizeof(superblock_t) && dh.bytes_per_block > 0 &&
+                dh.meta_len <= len - sizeof(dh) - sizeof(trailer);
+    }
+    if (!valid) {
+        fprintf(stderr, "Delta is damaged or incomplete.\n");
+        free(delta);
+        return 3;
+    }
+
+    // Walk the records once to check that they fit before applying any
+    uint32_t bpb = dh.bytes_per_block;
+    const uint8_t *records = delta + sizeof(dh) + dh.meta_len;
+    const uint8_t *limit = delta + len - sizeof(trailer);
+    const uint8_t *p = records;
+    for (uint32_t i = 0; i < dh.block_count && valid; i++) {
+        qfs_delta_rec_t rec;
+        if ((size_t)(limit - p) < sizeof(rec)) {
+            valid = 0;
+            break;
+        }
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.block >= dh.total_blocks ||
+            (rec.kind == QFS_DELTA_DATA && (size_t)(limit - p) < bpb) ||
+            (rec.kind != QFS_DELTA_DATA && rec.kind != QFS_DELTA_HOLE))
+            valid = 0;
+        else if (rec.kind == QFS_DELTA_DATA)
+            p += bpb;
+    }
+    if (!valid || p != limit) {
+        fprintf(stderr, "Delta is damaged or incomplete.\n");
+        free(delta);
+        return 3;
+    }
+
+    // ---------------------------------------------------
+    // Open the replica and check the delta applies to it
+    // ---------------------------------------------------
+    int fd = open(replica, dh.base == 0 ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    if (fd < 0) {
+        perror(replica);
+        free(delta);
+        return 4;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s: image is in use by qfsd.\n", replica);
+        close(fd);
+        free(delta);
+        return 4;
+    }
+
+    superblock_t sb;
+    memcpy(&sb, delta + sizeof(dh), sizeof(sb));
+    qfs_gen_header_t hdr;
+    uint32_t *gens = NULL;
+    int tracked = qfs_gen_load(replica, &sb, &hdr, &gens) == 0;
+    if (dh.base != 0) {
+        const char *why = NULL;
+        if (!tracked)
+            why = "it has no generation map; apply a full delta first";
+        else if (hdr.lineage != dh.lineage)
+            why = "it is a replica of a different image";
+        else if (hdr.generation < dh.base)
+            why = "it is older than the delta's base generation";
+        else if (hdr.generation > dh.generation)
+            why = "it is newer than the delta";
+        if (why) {
+            fprintf(stderr, "Cannot apply delta (generations %u to %u) to \"%s\": %s.\n",
+                    dh.base, dh.generation, replica, why);
+            free(gens);
+            close(fd);
+            free(delta);
+            return 5;
+        }
+    }
+    if (!tracked || hdr.lineage != dh.lineage) {
+        free(gens);
+        gens = calloc(dh.total_blocks ? dh.total_blocks : 1, sizeof(uint32_t));
+        if (!gens) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            close(fd);
+            free(delta);
+            return 7;
+        }
+        memcpy(hdr.magic, QFS_GEN_MAGIC, 4);
+        hdr.total_blocks = dh.total_blocks;
+        hdr.bytes_per_block = dh.bytes_per_block;
+        hdr.lineage = dh.lineage;
+    }
+
+    // ---------------------------------------------------
+    // Apply: metadata, then every block
+    // ---------------------------------------------------
+    int rc = 0;
+    uint32_t applied = 0;
+    int sparse = (sb.features & QFS_FEAT_SPARSE) != 0;
+    uint8_t *zeros = calloc(1, bpb);
+    if (!zeros ||
+        ftruncate(fd, (off_t)dh.image_size) != 0 ||
+        qfs_io_full(fd, 1, delta + sizeof(dh), dh.meta_len, 0) != (ssize_t)dh.meta_len)
+        rc = 6;
+
+    p = records;
+    for (uint32_t i = 0; i < dh.block_count && rc == 0; i++) {
+        qfs_delta_rec_t rec;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        off_t offset = (off_t)dh.meta_len + (off_t)rec.block * bpb;
+
+        if (rec.kind == QFS_DELTA_HOLE) {
+            if (!(sparse && qfs_io_punch(fd, offset, bpb) == 0) &&
+                qfs_io_full(fd, 1, zeros, bpb, offset) != (ssize_t)bpb)
+                rc = 6;
+        } else {
+            if (qfs_io_full(fd, 1, (void *)p, bpb, offset) != (ssize_t)bpb)
+                rc = 6;
+            p += bpb;
+        }
+        gens[rec.block] = dh.generation;
+        applied++;
+    }
+    if (rc == 0 && fsync(fd) != 0)
+        rc = 6;
+    free(zeros);
+    if (rc != 0) {
+        fprintf(stderr, "Error writing replica \"%s\".\n", replica);
+        free(gens);
+        close(fd);
+        free(delta);
+        return rc;
+    }
+
+    // ---------------------------------------------------
+    // Verify, then record the generation reached
+    // ---------------------------------------------------
+    uint32_t crc;
+    if (qfs_gen_image_crc(fd, dh.image_size, &crc) != 0 || crc != dh.image_crc) {
+        fprintf(stderr, "Replica \"%s\" does not match the source after applying the delta; "
+                        "seed it again from a full delta (generation 0).\n", replica);
+        free(gens);
+        close(fd);
+        free(delta);
+        return 8;
+    }
+
+    hdr.generation = dh.generation;
+    if (qfs_gen_save(replica, &hdr, gens) != 0) {
+        perror("generation map");
+        rc = 6;
+    }
+
+    // A dedup hash index of the replica no longer describes its blocks
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.qdx", replica);
+    unlink(index_path);
+
+    if (rc == 0)
+        printf("Replica \"%s\" at generation %u: applied %u block(s), verified.\n",
+               replica, dh.generation, applied);
+
+    free(gens);
+    close(fd);
+    free(delta);
+    return rc;
+}
@@ -0,0 +1,545 @@
+/*
+ * CSC 310 - Operating Systems Final Project
+ * qfs_tar.c
+ *
+ * Usage:
+ *   ./qfs_tar -c <disk image file> > archive.tar
+ *   ./qfs_tar -x <disk image file> < archive.tar
+ *
+ * Moves whole images in and out of tar streams in one sequential pass, so
+ * they can be piped through compression or network tools without staging
+ * copies on disk:
+ *
+ *   -c  writes every file in the image to standard output as a ustar
+ *       archive, in directory order
+ *   -x  reads a tar archive from standard input and stores each regular
+ *       file in the image under its base name (truncated to the 22
+ *       characters a directory entry holds). Other members (directories,
+ *       links, ...) are skipped.
+ *
+ * Both directions stream (see qfs_stream.h): imported files are written as
+ * their data arrives, and exported files are read with chain read-ahead.
+ * With QFS_DIRECT=1 the export reads the image with O_DIRECT. With QFS_TRACE
+ * set each imported file is recorded as a write (see qfs_trace.h).
+ *
+ * When QFSD_SOCKET is set and the qfsd daemon serves the image, -x hands
+ * each file to the daemon as it is read (see qfsd_proto.h). An export reads
+ * the image itself and is refused while the image is locked against it
+ * (by qfsd, or by a tool writing it).
+ */
+
+#define _GNU_SOURCE               // O_DIRECT, SEEK_DATA (see qfs_io.h)
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "qfs.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+#include "qfs_stream.h"
+#include "qfsd_proto.h"
+#include "qfs_trace.h"
+
+#define TAR_BLOCK 512
+
+// POSIX ustar header
+typedef struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+static const char *basename_simple(const char *path) {
+    // Return the filename portion of a path (after the last '/' or '\\').
+    const char *base = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' || *p == '\\')
+            base = p + 1;
+    }
+    return base;
+}
+
+static unsigned tar_checksum(const tar_header_t *h) {
+    // Sum of the header bytes with the checksum field counted as spaces
+    const uint8_t *p = (const uint8_t *)h;
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(*h); i++)
+        sum += (i >= offsetof(tar_header_t, chksum) &&
+                i < offsetof(tar_header_t, chksum) + sizeof(h->chksum)) ? ' ' : p[i];
+    return sum;
+}
+
+static uint64_t tar_number(const char *field, size_t len) {
+    // Octal, or GNU base-256 when the high bit of the first byte is set
+    const uint8_t *p = (const uint8_t *)field;
+    uint64_t v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7F;
+        for (size_t i = 1; i < len; i++)
+            v = (v << 8) | p[i];
+        return v;
+    }
+    for (size_t i = 0; i < len && p[i]; i++) {
+        if (p[i] >= '0' && p[i] <= '7')
+            v = v * 8 + (p[i] - '0');
+    }
+    return v;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    // Exactly len bytes from a pipe; -1 at end of input or on error.
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int skip_input(int fd, uint64_t len) {
+    uint8_t buf[TAR_BLOCK * 16];
+    while (len > 0) {
+        size_t n = len > sizeof(buf) ? sizeof(buf) : (size_t)len;
+        if (read_full(fd, buf, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Export                                                                  */
+/* ---------------------------------------------------------------------- */
+
+static int export_image(const char *image) {
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Refusing to write a tar archive to a terminal.\n");
+        return 1;
+    }
+
+    int io_mode;
+    int fd = qfs_io_open(image, O_RDONLY, &io_mode);
+    if (fd < 0) {
+        perror("open");
+        return 2;
+    }
+    if (qfsd_lock_image(fd, image, 0) != 0) {
+        close(fd);
+        return 2;
+    }
+
+    // Superblock and directory through aligned reads (direct I/O safe)
+    qfs_pool_t pool;
+    if (qfs_pool_init(&pool, qfs_io_span(sizeof(superblock_t)), 1) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        close(fd);
+        return 7;
+    }
+    superblock_t sb;
+    const uint8_t *sb_bytes = qfs_io_read_span(fd, pool.slab, sizeof(sb), 0);
+    if (sb_bytes)
+        memcpy(&sb, sb_bytes, sizeof(sb));
+    qfs_pool_destroy(&pool);
+    if (!sb_bytes) {
+        fprintf(stderr, "Error reading superblock.\n");
+        close(fd);
+        return 3;
+    }
+    if (sb.fs_type != 0x51) {
+        fprintf(stderr, "Not a valid QFS filesystem.\n");
+        close(fd);
+        return 4;
+    }
+
+    size_t dir_len = sizeof(direntry_t) * sb.total_direntries;
+    direntry_t *dir = malloc(dir_len ? dir_len : 1);
+    if (!dir || qfs_pool_init(&pool, qfs_io_span(sizeof(superblock_t) + dir_len), 1) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(dir);
+        close(fd);
+        return 7;
+    }
+    const uint8_t *dir_bytes = qfs_io_read_span(fd, pool.slab, dir_len, sizeof(superblock_t));
+    if (dir_bytes)
+        memcpy(dir, dir_bytes, dir_len);
+    qfs_pool_destroy(&pool);
+    if (!dir_bytes) {
+        fprintf(stderr, "Error reading directory.\n");
+        free(dir);
+        close(fd);
+        return 5;
+    }
+
+    qfs_io_t io;
+    qfs_io_init(&io, fd);
+    io.direct = (io_mode == QFS_IO_DIRECT);
+
+    static const uint8_t zeros[TAR_BLOCK * 2];
+    time_t now = time(NULL);
+    int rc = 0;
+
+    for (int i = 0; i < sb.total_direntries && rc == 0; i++) {
+        const direntry_t *d = &dir[i];
+        if (d->filename[0] == '\0' || d->filename[0] == QFS_DIRENT_CONT)
+            continue;
+
+        tar_header_t h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.name, d->filename, strnlen(d->filename, sizeof(d->filename)));
+        snprintf(h.mode, sizeof(h.mode), "%07o", 0644);
+        snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+        snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+        snprintf(h.size, sizeof(h.size), "%011o", d->file_size);
+        snprintf(h.mtime, sizeof(h.mtime), "%011llo", (unsigned long long)now);
+        h.typeflag = '0';
+        memcpy(h.magic, "ustar", 6);
+        memcpy(h.version, "00", 2);
+        snprintf(h.chksum, sizeof(h.chksum), "%06o", tar_checksum(&h));
+        h.chksum[7] = ' ';
+
+        if (fwrite(&h, sizeof(h), 1, stdout) != 1) {
+            rc = 6;
+            break;
+        }
+        int err = qfs_stream_read(&io, &sb, dir, i, stdout, NULL);
+        if (err == QFS_STREAM_EOUTPUT) {
+            rc = 6;
+        } else if (err == QFS_STREAM_ECRC) {
+            fprintf(stderr, "Checksum mismatch in \"%.23s\".\n", d->filename);
+            rc = 9;
+        } else if (err == QFS_STREAM_ENOMEM) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            rc = 7;
+        } else if (err != 0) {
+            fprintf(stderr, "Error exporting \"%.23s\".\n", d->filename);
+            rc = 8;
+        } else if (fwrite(zeros, tar_padding(d->file_size), 1, stdout) != 1 &&
+                   tar_padding(d->file_size) != 0) {
+            rc = 6;
+        }
+    }
+
+    // End-of-archive marker
+    if (rc == 0 && (fwrite(zeros, sizeof(zeros), 1, stdout) != 1 || fflush(stdout) != 0))
+        rc = 6;
+    if (rc == 6)
+        fprintf(stderr, "Error writing tar archive.\n");
+
+    qfs_io_close(&io);
+    qfs_io_release(fd, io_mode, 0, 0);
+    close(fd);
+    free(dir);
+    return rc;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Import                                                                  */
+/* ---------------------------------------------------------------------- */
+
+static int next_member(char *long_name, char *path, uint64_t *size) {
+    // Read up to the next regular file in the archive on standard input,
+    // skipping every other member. Stores its path (TAR_BLOCK + 1 bytes)
+    // and size and returns 1, or returns 0 at the end of the archive and
+    // -1, with a message, if the archive is damaged or cut short. long_name
+    // carries a GNU long name from one call to the next.
+    for (;;) {
+        tar_header_t h;
+        if (read_full(STDIN_FILENO, &h, sizeof(h)) != 0) {
+            fprintf(stderr, "Unexpected end of tar archive.\n");
+            return -1;
+        }
+
+        static const tar_header_t zero;
+        if (memcmp(&h, &zero, sizeof(h)) == 0)
+            return 0;             // end-of-archive marker
+        if (tar_number(h.chksum, sizeof(h.chksum)) != tar_checksum(&h)) {
+            fprintf(stderr, "Invalid tar header.\n");
+            return -1;
+        }
+
+        *size = tar_number(h.size, sizeof(h.size));
+
+        // GNU long name: the next member's name is this member's data
+        if (h.typeflag == 'L') {
+            size_t keep = *size < TAR_BLOCK ? (size_t)*size : TAR_BLOCK;
+            if (read_full(STDIN_FILENO, long_name, keep) != 0 ||
+                skip_input(STDIN_FILENO, *size - keep + tar_padding(*size)) != 0) {
+                fprintf(stderr, "Unexpected end of tar archive.\n");
+                return -1;
+            }
+            long_name[keep] = '\0';
+            continue;
+        }
+
+        if (long_name[0]) {
+            snprintf(path, TAR_BLOCK + 1, "%s", long_name);
+            long_name[0] = '\0';
+        } else if (h.prefix[0] && memcmp(h.magic, "ustar", 5) == 0) {
+            snprintf(path, TAR_BLOCK + 1, "%.*s/%.*s", (int)sizeof(h.prefix), h.prefix,
+                     (int)sizeof(h.name), h.name);
+        } else {
+            snprintf(path, TAR_BLOCK + 1, "%.*s", (int)sizeof(h.name), h.name);
+        }
+        const char *name = basename_simple(path);
+
+        int regular = h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7';
+        if (regular && name[0] != '\0' && (uint8_t)name[0] != QFS_DIRENT_CONT)
+            return 1;
+
+        if (h.typeflag != 'x' && h.typeflag != 'g' && h.typeflag != '5')
+            fprintf(stderr, "Skipping \"%s\" (not a regular file).\n", path);
+        if (skip_input(STDIN_FILENO, *size + tar_padding(*size)) != 0) {
+            fprintf(stderr, "Unexpected end of tar archive.\n");
+            return -1;
+        }
+    }
+}
+
+static int import_via_daemon(const char *image) {
+    // Hand each file to qfsd as it is read from the archive. Returns the
+    // exit code, or -1 if there is no daemon serving the image.
+    if (!getenv(QFSD_SOCKET_ENV))
+        return -1;
+
+    // Find out before any of the archive is consumed
+    void *reply;
+    uint32_t reply_len;
+    int status = qfsd_call(image, QFSD_OP_STAT, "", NULL, 0, &reply, &reply_len);
+    free(reply);
+    if (status == QFSD_NODAEMON || status == QFSD_NOIMAGE)
+        return -1;
+    if (status == QFSD_FAILED) {
+        qfsd_perror(image);
+        return 2;
+    } else if (status != QFSD_OK) {
+        fprintf(stderr, "Error reading superblock.\n");
+        return 3;
+    }
+
+    char long_name[TAR_BLOCK + 1] = "";
+    char path[TAR_BLOCK + 1];
+    uint64_t size;
+    uint32_t imported = 0;
+    int rc = 0;
+    int more;
+
+    while (rc == 0 && (more = next_member(long_name, path, &size)) != 0) {
+        if (more < 0) {
+            rc = 6;
+            break;
+        }
+        const char *name = basename_simple(path);
+
+        int input_error;
+        status = qfsd_call_fd(image, QFSD_OP_WRITE, name, STDIN_FILENO, size,
+                              &input_error, &reply, &reply_len);
+        free(reply);
+        if (input_error) {
+            fprintf(stderr, "Unexpected end of tar archive.\n");
+            rc = 6;
+        } else if (status == QFSD_NOSPACE) {
+            fprintf(stderr, "Not enough space for \"%s\".\n", name);
+            rc = 10;
+        } else if (status == QFSD_NOMEM) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            rc = 7;
+        } else if (status == QFSD_FAILED) {
+            qfsd_perror(image);
+            rc = 11;
+        } else if (status != QFSD_OK) {
+            fprintf(stderr, "Error writing \"%s\" to disk image.\n", name);
+            rc = 11;
+        } else {
+            imported++;
+            if (skip_input(STDIN_FILENO, tar_padding(size)) != 0) {
+                fprintf(stderr, "Unexpected end of tar archive.\n");
+                rc = 6;
+            }
+        }
+    }
+
+    if (rc == 0)
+        printf("Imported %u file(s) into \"%s\".\n", imported, image);
+    return rc;
+}
+
+static int import_image(const char *image) {
+    int forwarded = import_via_daemon(image);
+    if (forwarded >= 0)
+        return forwarded;
+
+    int fd = open(image, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return 2;
+    }
+    if (qfsd_lock_image(fd, image, 1) != 0) {
+        close(fd);
+        return 2;
+    }
+
+    superblock_t sb;
+    if (qfs_io_full(fd, 0, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        fprintf(stderr, "Error reading superblock.\n");
+        close(fd);
+        return 3;
+    }
+    if (sb.fs_type != 0x51) {
+        fprintf(stderr, "Not a valid QFS filesystem.\n");
+        close(fd);
+        return 4;
+    }
+
+    size_t dir_len = sizeof(direntry_t) * sb.total_direntries;
+    direntry_t *dir = malloc(dir_len ? dir_len : 1);
+    qfs_alloc_t alloc;
+    if (!dir || qfs_alloc_init(&alloc, fd, &sb) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(dir);
+        close(fd);
+        return 7;
+    }
+    if (qfs_io_full(fd, 0, dir, dir_len, sizeof(superblock_t)) != (ssize_t)dir_len) {
+        fprintf(stderr, "Error reading directory.\n");
+        qfs_alloc_destroy(&alloc);
+        free(dir);
+        close(fd);
+        return 5;
+    }
+
+    qfs_gen_t gen;
+    qfs_gen_open(&gen, image);
+    alloc.gen = &gen;
+
+    char long_name[TAR_BLOCK + 1] = "";
+    char path[TAR_BLOCK + 1];       // holds a long name or prefix/name
+    uint64_t size;
+    uint32_t imported = 0;
+    int trace_fd = qfs_trace_open();
+    int rc = 0;
+
+    for (;;) {
+        int more = next_member(long_name, path, &size);
+        if (more < 0) {
+            rc = 6;
+            break;
+        }
+        if (more == 0)
+            break;
+        const char *name = basename_simple(path);
+
+        int dir_index = -1;
+        for (int i = 0; i < sb.total_direntries && sb.available_direntries > 0; i++) {
+            if (dir[i].filename[0] == '\0') {
+                dir_index = i;
+                break;
+            }
+        }
+        if (dir_index < 0) {
+            fprintf(stderr, "No free directory entry for \"%s\".\n", name);
+            rc = 8;
+            break;
+        }
+
+        uint64_t start_ns = qfs_trace_now();
+        uint16_t starting_block;
+        uint32_t blocks_used, file_size;
+        int err = qfs_stream_write(&alloc, STDIN_FILENO, size,
+                                   &starting_block, &blocks_used, &file_size);
+        if (err == QFS_STREAM_ENOSPC) {
+            fprintf(stderr, "Not enough free blocks for \"%s\".\n", name);
+            rc = 10;
+            break;
+        } else if (err == QFS_STREAM_EINPUT) {
+            fprintf(stderr, "Unexpected end of tar archive.\n");
+            rc = 6;
+            break;
+        } else if (err == QFS_STREAM_ENOMEM) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            rc = 7;
+            break;
+        } else if (err != 0) {
+            fprintf(stderr, "Error writing \"%s\" to disk image.\n", name);
+            rc = 11;
+            break;
+        }
+
+        // Entry and counts go out after each file, so an interrupted
+        // import leaves every file before it intact
+        direntry_t *d = &dir[dir_index];
+        memset(d, 0, sizeof(*d));
+        size_t name_len = strlen(name);
+        if (name_len > sizeof(d->filename) - 1)
+            name_len = sizeof(d->filename) - 1;
+        memcpy(d->filename, name, name_len);
+        d->starting_block = starting_block;
+        d->file_size = file_size;
+        sb.available_blocks -= blocks_used;
+        sb.available_direntries--;
+        if (qfs_io_full(fd, 1, d, sizeof(*d),
+                        sizeof(superblock_t) + (off_t)dir_index * sizeof(direntry_t)) != sizeof(*d) ||
+            qfs_io_full(fd, 1, &sb, sizeof(sb), 0) != sizeof(sb)) {
+            fprintf(stderr, "Error updating directory.\n");
+            rc = 11;
+            break;
+        }
+        imported++;
+        qfs_trace_append(trace_fd, QFS_TRACE_WRITE, d->filename, file_size, 0, start_ns);
+
+        if (skip_input(STDIN_FILENO, tar_padding(size)) != 0) {
+            fprintf(stderr, "Unexpected end of tar archive.\n");
+            rc = 6;
+            break;
+        }
+    }
+
+    qfs_gen_close(&gen);
+    qfs_alloc_destroy(&alloc);
+    free(dir);
+    close(fd);
+    if (trace_fd >= 0)
+        close(trace_fd);
+
+    if (rc == 0)
+        printf("Imported %u file(s) into \"%s\".\n", imported, image);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc != 3 || (strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-x") != 0)) {
+        fprintf(stderr, "Usage: %s -c <disk image file> > archive.tar\n"
+                        "       %s -x <disk image file> < archive.tar\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    return strcmp(argv[1], "-c") == 0 ? export_image(argv[2]) : import_image(argv[2]);
+}
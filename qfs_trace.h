@@ -0,0 +1,117 @@
+/*
+**
+** Operation traces for QFS tools.
+**
+** When QFS_TRACE names a file, every write_file, read_file, delete_file and
+** list_information run, every file imported by qfs_tar -x and every request
+** served by qfsd appends one fixed-size record to it: when the operation
+** started, how long it took, what it was, which file and how many bytes,
+** and how it ended. Records are written with a single O_APPEND write(), so
+** any number of processes can share one trace. An operation a tool hands to
+** qfsd is recorded by the daemon only.
+**
+** qfs_replay runs a trace against a freshly formatted image.
+**
+** Usage: #include "qfs_trace.h"
+**
+*/
+
+#ifndef QFS_TRACE_H
+#define QFS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define QFS_TRACE_ENV     "QFS_TRACE"
+
+#define QFS_TRACE_WRITE   1
+#define QFS_TRACE_READ    2
+#define QFS_TRACE_DELETE  3
+#define QFS_TRACE_LIST    4
+#define QFS_TRACE_STAT    5
+
+#define QFS_TRACE_NAME    23      // as in direntry_t
+
+// One operation, 48 bytes, little-endian as written by the tools.
+typedef struct __attribute__((packed)) qfs_trace_rec {
+    uint64_t start_ns;            // CLOCK_REALTIME when the operation began
+    uint64_t duration_ns;
+    uint32_t size;                // file bytes written, read or deleted
+    uint8_t  op;                  // QFS_TRACE_*
+    uint8_t  status;              // exit code (tools) or QFSD_* status (qfsd)
+    char     name[QFS_TRACE_NAME];  // NUL-padded, "" for list
+    uint8_t  reserved[3];
+} qfs_trace_rec_t;
+
+static inline uint64_t qfs_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Descriptor of the trace named by QFS_TRACE, or -1 when tracing is off.
+static inline int qfs_trace_open(void) {
+    const char *path = getenv(QFS_TRACE_ENV);
+    if (!path || !*path)
+        return -1;
+    return open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+static inline void qfs_trace_append(int fd, uint8_t op, const char *name, uint32_t size,
+                                    int status, uint64_t start_ns) {
+    if (fd < 0)
+        return;
+    qfs_trace_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.start_ns = start_ns;
+    rec.duration_ns = qfs_trace_now() - start_ns;
+    rec.size = size;
+    rec.op = op;
+    rec.status = (uint8_t)status;
+    snprintf(rec.name, sizeof(rec.name), "%s", name);
+    ssize_t r = write(fd, &rec, sizeof(rec));
+    (void)r;                      // a lost record must not fail the operation
+}
+
+// Per-process record of a CLI tool's single operation: begun in main(),
+// filled in by the tool as it learns the size, appended on the way out.
+static struct {
+    uint64_t start_ns;
+    uint8_t  op;
+    uint32_t size;
+    int      skip;
+    char     name[QFS_TRACE_NAME];
+} qfs_trace_op;
+
+static inline void qfs_trace_begin(uint8_t op, const char *name) {
+    qfs_trace_op.start_ns = qfs_trace_now();
+    qfs_trace_op.op = op;
+    snprintf(qfs_trace_op.name, sizeof(qfs_trace_op.name), "%s", name ? name : "");
+}
+
+static inline void qfs_trace_size(uint32_t size) {
+    qfs_trace_op.size = size;
+}
+
+// The operation went to qfsd, which records it itself.
+static inline void qfs_trace_skip(void) {
+    qfs_trace_op.skip = 1;
+}
+
+static inline void qfs_trace_end(int status) {
+    if (qfs_trace_op.skip)
+        return;
+    int fd = qfs_trace_open();
+    if (fd < 0)
+        return;
+    qfs_trace_append(fd, qfs_trace_op.op, qfs_trace_op.name, qfs_trace_op.size,
+                     status, qfs_trace_op.start_ns);
+    close(fd);
+}
+
+#endif
@@ -0,0 +1,1193 @@
+/*
+ * CSC 310 - Operating Systems Final Project
+ * qfsd.c
+ *
+ * Usage:
+ *   ./qfsd [-s <socket>] [-c <cache blocks>] <disk image file> [...]
+ *
+ * Long-lived daemon that keeps one or more QFS images open and serves
+ * write, read, delete, list and stat requests over a Unix-domain socket
+ * (protocol in qfsd_proto.h). The socket defaults to $QFSD_SOCKET, or
+ * /tmp/qfsd.sock when that is unset.
+ *
+ * Each image is opened and validated once, and the state the CLI tools
+ * rebuild on every run is kept warm in memory:
+ *
+ *   - the whole directory, continuation records included
+ *   - a free map with one bit per block, built by a single scan at startup
+ *   - block maps: each file's chain, recorded when it is written or first
+ *     walked, so later reads and deletes need not follow next pointers
+ *   - an LRU cache of blocks (-c, default 4096 per image); misses read a
+ *     run of following blocks, which is where write_file puts the rest of
+ *     a file
+ *
+ * Changes are written through to the image before a request is answered.
+ * All clients are served from one thread with poll(): every connection may
+ * pipeline any number of requests, which are executed in order, and
+ * replies are sent as the socket accepts them.
+ *
+ * The daemon writes plain (or, with -c images, checksummed) block chains and
+ * inline files on packed images; it reads and deletes files in every layout
+ * the tools produce. It does not maintain the deduplication index, and
+ * removes "<image>.qdx" after changing a deduplicated image so that
+ * write_file rebuilds it. While qfsd serves an image it holds an exclusive
+ * lock on it, and the CLI tools refuse to open the image directly: set
+ * QFSD_SOCKET for them to go through the daemon.
+ *
+ * With QFS_TRACE set in the daemon's environment every request served is
+ * recorded in that operation trace (see qfs_trace.h).
+ */
+
+#define _GNU_SOURCE               // fallocate(), SEEK_DATA (see qfs_io.h)
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+#include "qfs_kernels.h"
+#include "qfs_pack.h"
+#include "qfsd_proto.h"
+#include "qfs_trace.h"
+
+#define QFSD_DEFAULT_SOCKET "/tmp/qfsd.sock"
+#define QFSD_DEFAULT_CACHE  4096  // cached blocks per image
+#define QFSD_MAX_IMAGES     16
+#define QFSD_MAX_CLIENTS    256
+#define QFSD_READ_RUN       16    // blocks read on a cache miss
+#define QFSD_WRITE_RUN      64    // blocks framed per pwrite()
+#define QFSD_SCAN_BLOCKS    256   // blocks read per pread() by the startup scan
+#define QFSD_RECV_CHUNK     65536
+#define QFSD_OUT_HIGH       (8u << 20)  // stop reading a client with this much unsent
+
+/* ---------------------------------------------------------------------- */
+/* LRU block cache                                                         */
+/* ---------------------------------------------------------------------- */
+
+typedef struct block_cache {
+    uint32_t  bpb;
+    uint32_t  cap;
+    uint32_t  count;
+    uint8_t  *data;               // cap blocks
+    uint16_t *block;              // block held by each slot
+    int32_t  *prev, *next;        // LRU list through the slots, MRU first
+    int32_t   head, tail;
+    int32_t  *slot_of;            // slot holding each block, or -1
+} block_cache_t;
+
+static int cache_init(block_cache_t *c, uint32_t total_blocks, uint32_t bpb, uint32_t cap) {
+    memset(c, 0, sizeof(*c));
+    c->bpb = bpb;
+    c->cap = cap;
+    c->head = c->tail = -1;
+    c->data = malloc((size_t)cap * bpb);
+    c->block = malloc(sizeof(uint16_t) * cap);
+    c->prev = malloc(sizeof(int32_t) * cap);
+    c->next = malloc(sizeof(int32_t) * cap);
+    c->slot_of = malloc(sizeof(int32_t) * (total_blocks ? total_blocks : 1));
+    if (!c->data || !c->block || !c->prev || !c->next || !c->slot_of)
+        return -1;
+    for (uint32_t b = 0; b < total_blocks; b++)
+        c->slot_of[b] = -1;
+    return 0;
+}
+
+static void cache_free(block_cache_t *c) {
+    free(c->data);
+    free(c->block);
+    free(c->prev);
+    free(c->next);
+    free(c->slot_of);
+}
+
+static void cache_unlink(block_cache_t *c, int32_t s) {
+    if (c->prev[s] >= 0)
+        c->next[c->prev[s]] = c->next[s];
+    else
+        c->head = c->next[s];
+    if (c->next[s] >= 0)
+        c->prev[c->next[s]] = c->prev[s];
+    else
+        c->tail = c->prev[s];
+}
+
+static void cache_push_front(block_cache_t *c, int32_t s) {
+    c->prev[s] = -1;
+    c->next[s] = c->head;
+    if (c->head >= 0)
+        c->prev[c->head] = s;
+    c->head = s;
+    if (c->tail < 0)
+        c->tail = s;
+}
+
+// Cached copy of block b without changing its LRU position, or NULL.
+static uint8_t *cache_peek(block_cache_t *c, uint16_t b) {
+    int32_t s = c->slot_of[b];
+    return s >= 0 ? c->data + (size_t)s * c->bpb : NULL;
+}
+
+static uint8_t *cache_lookup(block_cache_t *c, uint16_t b) {
+    int32_t s = c->slot_of[b];
+    if (s < 0)
+        return NULL;
+    if (c->head != s) {
+        cache_unlink(c, s);
+        cache_push_front(c, s);
+    }
+    return c->data + (size_t)s * c->bpb;
+}
+
+// Store a copy of block b as the most recently used, evicting the least
+// recently used block when full. Returns the cached copy.
+static uint8_t *cache_insert(block_cache_t *c, uint16_t b, const uint8_t *block) {
+    int32_t s = c->slot_of[b];
+    if (s >= 0) {
+        cache_unlink(c, s);
+    } else if (c->count < c->cap) {
+        s = c->count++;
+    } else {
+        s = c->tail;
+        cache_unlink(c, s);
+        if (c->block[s] != 0xFFFF)
+            c->slot_of[c->block[s]] = -1;
+    }
+    c->block[s] = b;
+    c->slot_of[b] = s;
+    cache_push_front(c, s);
+
+    uint8_t *dst = c->data + (size_t)s * c->bpb;
+    memcpy(dst, block, c->bpb);
+    return dst;
+}
+
+// Drop block b from the cache; its slot is the next one reused.
+static void cache_forget(block_cache_t *c, uint16_t b) {
+    int32_t s = c->slot_of[b];
+    if (s < 0)
+        return;
+    c->slot_of[b] = -1;
+    c->block[s] = 0xFFFF;         // never a block number
+    cache_unlink(c, s);
+    c->next[s] = -1;
+    c->prev[s] = c->tail;
+    if (c->tail >= 0)
+        c->next[c->tail] = s;
+    c->tail = s;
+    if (c->head < 0)
+        c->head = s;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Images                                                                  */
+/* ---------------------------------------------------------------------- */
+
+typedef struct image {
+    char           path[PATH_MAX];
+    int            fd;
+    superblock_t   sb;
+    qfs_kernels_t  kern;          // chosen for the block size at open
+    long           data_start;
+    direntry_t    *dir;           // total_direntries entries
+    uint16_t     **maps;          // per entry: its block chain, or NULL
+    uint32_t      *map_len;
+    uint64_t      *freemap;       // bit set = block is free
+    block_cache_t  cache;
+    uint8_t       *scratch;       // QFSD_WRITE_RUN blocks
+} image_t;
+
+static image_t images[QFSD_MAX_IMAGES];
+static int image_count;
+
+static volatile sig_atomic_t stop;
+static int trace_fd = -1;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static void set_free(image_t *img, uint32_t b, int free_) {
+    if (free_)
+        img->freemap[b / 64] |= 1ull << (b % 64);
+    else
+        img->freemap[b / 64] &= ~(1ull << (b % 64));
+}
+
+static off_t block_offset(const image_t *img, uint16_t b) {
+    return img->data_start + (off_t)b * img->sb.bytes_per_block;
+}
+
+static int write_superblock(image_t *img, const superblock_t *sb) {
+    return qfs_io_full(img->fd, 1, (void *)sb, sizeof(superblock_t), 0) ==
+           (ssize_t)sizeof(superblock_t) ? 0 : -1;
+}
+
+static int write_direntries(image_t *img, int first, const direntry_t *entries,
+                            uint32_t count) {
+    size_t len = sizeof(direntry_t) * count;
+    return qfs_io_full(img->fd, 1, (void *)entries, len,
+                       sizeof(superblock_t) + (off_t)first * sizeof(direntry_t)) ==
+           (ssize_t)len ? 0 : -1;
+}
+
+// Write directory records first..first+count-1 and the superblock, and only
+// once both are on disk adopt them in memory. On failure the in-memory
+// image is unchanged and the old records are written back where possible.
+static int commit_entries(image_t *img, int first, const direntry_t *entries,
+                          uint32_t count, const superblock_t *sb) {
+    if (write_direntries(img, first, entries, count) != 0 ||
+        write_superblock(img, sb) != 0) {
+        write_direntries(img, first, &img->dir[first], count);
+        write_superblock(img, &img->sb);
+        return QFSD_IO;
+    }
+    memcpy(&img->dir[first], entries, sizeof(direntry_t) * count);
+    img->sb = *sb;
+    return QFSD_OK;
+}
+
+// Return blocks written for a request that failed: clear their busy bytes
+// (or punch them out of sparse images) so that a restart's scan finds them
+// free, as the free map still has them.
+static void release_blocks(image_t *img, const uint16_t *blocks, uint32_t n) {
+    uint32_t bpb = img->sb.bytes_per_block;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t zero = 0x00;
+        cache_forget(&img->cache, blocks[i]);
+        if (!((img->sb.features & QFS_FEAT_SPARSE) &&
+              qfs_io_punch(img->fd, block_offset(img, blocks[i]), bpb) == 0))
+            qfs_io_full(img->fd, 1, &zero, 1, block_offset(img, blocks[i]));
+    }
+}
+
+static void drop_map(image_t *img, int idx) {
+    free(img->maps[idx]);
+    img->maps[idx] = NULL;
+    img->map_len[idx] = 0;
+}
+
+// Block b through the cache. A miss reads b and the blocks after it in one
+// pread(). The pointer is valid until the next cache insertion.
+static const uint8_t *image_block(image_t *img, uint16_t b) {
+    if (b >= img->sb.total_blocks)
+        return NULL;
+    uint8_t *hit = cache_lookup(&img->cache, b);
+    if (hit)
+        return hit;
+
+    uint32_t bpb = img->sb.bytes_per_block;
+    uint32_t n = img->sb.total_blocks - b;
+    if (n > QFSD_READ_RUN)
+        n = QFSD_READ_RUN;
+    ssize_t got = qfs_io_full(img->fd, 0, img->scratch, (size_t)n * bpb, block_offset(img, b));
+    if (got < (ssize_t)bpb)
+        return NULL;
+    n = got / bpb;
+
+    // Insert the read-ahead first so that b ends up most recently used
+    for (uint32_t i = n; i-- > 1; ) {
+        if (!cache_peek(&img->cache, b + i))
+            cache_insert(&img->cache, b + i, img->scratch + (size_t)i * bpb);
+    }
+    return cache_insert(&img->cache, b, img->scratch);
+}
+
+// The chain of directory entry idx, from the block map or by walking it.
+static int image_map(image_t *img, int idx, const uint16_t **map, uint32_t *len) {
+    if (img->maps[idx] || img->dir[idx].starting_block == 0xFFFF) {
+        *map = img->maps[idx];
+        *len = img->map_len[idx];
+        return QFSD_OK;
+    }
+
+    uint16_t *chain = malloc(sizeof(uint16_t) * img->sb.total_blocks);
+    if (!chain)
+        return QFSD_NOMEM;
+
+    uint32_t n = 0;
+    uint16_t b = img->dir[idx].starting_block;
+    while (b != 0xFFFF && n < img->sb.total_blocks) {
+        const uint8_t *block = image_block(img, b);
+        if (!block) {
+            free(chain);
+            return QFSD_IO;
+        }
+        chain[n++] = b;
+        img->kern.links(&img->kern, block, 1, &b);
+    }
+
+    uint16_t *shrunk = realloc(chain, sizeof(uint16_t) * (n ? n : 1));
+    img->maps[idx] = shrunk ? shrunk : chain;
+    img->map_len[idx] = n;
+    *map = img->maps[idx];
+    *len = n;
+    return QFSD_OK;
+}
+
+static int image_open(image_t *img, const char *path, uint32_t cache_blocks) {
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    if (!realpath(path, img->path)) {
+        perror(path);
+        return -1;
+    }
+
+    img->fd = open(img->path, O_RDWR);
+    if (img->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (flock(img->fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s: image is already served by another qfsd.\n", path);
+        return -1;
+    }
+
+    if (qfs_io_full(img->fd, 0, &img->sb, sizeof(superblock_t), 0) != sizeof(superblock_t)) {
+        fprintf(stderr, "%s: error reading superblock.\n", path);
+        return -1;
+    }
+    if (img->sb.fs_type != 0x51) {
+        fprintf(stderr, "%s: not a valid QFS filesystem.\n", path);
+        return -1;
+    }
+
+    superblock_t *sb = &img->sb;
+    uint32_t bpb = sb->bytes_per_block;
+    qfs_kernels_init(&img->kern, sb);
+    img->data_start = sizeof(superblock_t) + (long)sizeof(direntry_t) * sb->total_direntries;
+    img->dir = calloc(sb->total_direntries ? sb->total_direntries : 1, sizeof(direntry_t));
+    img->maps = calloc(sb->total_direntries ? sb->total_direntries : 1, sizeof(uint16_t *));
+    img->map_len = calloc(sb->total_direntries ? sb->total_direntries : 1, sizeof(uint32_t));
+    img->freemap = calloc(((uint32_t)sb->total_blocks + 63) / 64 + 1, sizeof(uint64_t));
+    img->scratch = malloc((size_t)bpb * QFSD_SCAN_BLOCKS);
+    if (cache_blocks < 2 * QFSD_READ_RUN)
+        cache_blocks = 2 * QFSD_READ_RUN;
+    if (!img->dir || !img->maps || !img->map_len || !img->freemap || !img->scratch ||
+        cache_init(&img->cache, sb->total_blocks, bpb, cache_blocks) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+
+    size_t dir_len = sizeof(direntry_t) * sb->total_direntries;
+    if (qfs_io_full(img->fd, 0, img->dir, dir_len, sizeof(superblock_t)) != (ssize_t)dir_len) {
+        fprintf(stderr, "%s: error reading directory.\n", path);
+        return -1;
+    }
+
+    // Build the free map from the busy bytes; holes hold only free blocks
+    for (uint32_t b = 0; b < sb->total_blocks; ) {
+        uint32_t n = sb->total_blocks - b;
+        if (n > QFSD_SCAN_BLOCKS)
+            n = QFSD_SCAN_BLOCKS;
+        off_t offset = img->data_start + (off_t)b * bpb;
+        if (qfs_io_range_is_hole(img->fd, offset, (off_t)n * bpb)) {
+            for (uint32_t i = 0; i < n; i++)
+                set_free(img, b + i, 1);
+        } else {
+            if (qfs_io_full(img->fd, 0, img->scratch, (size_t)n * bpb, offset) != (ssize_t)n * bpb) {
+                fprintf(stderr, "%s: error reading data blocks.\n", path);
+                return -1;
+            }
+            for (uint32_t i = 0; i < n; i++)
+                set_free(img, b + i, img->scratch[(size_t)i * bpb] == 0x00);
+        }
+        b += n;
+    }
+    return 0;
+}
+
+static void image_close(image_t *img) {
+    if (img->fd >= 0) {
+        fsync(img->fd);
+        close(img->fd);
+    }
+    for (uint32_t i = 0; img->maps && i < img->sb.total_direntries; i++)
+        free(img->maps[i]);
+    free(img->maps);
+    free(img->map_len);
+    free(img->dir);
+    free(img->freemap);
+    free(img->scratch);
+    cache_free(&img->cache);
+}
+
+static image_t *find_image(const char *path) {
+    for (int i = 0; i < image_count; i++) {
+        if (strcmp(images[i].path, path) == 0)
+            return &images[i];
+    }
+    return NULL;
+}
+
+static int is_file_entry(const direntry_t *d) {
+    return d->filename[0] != '\0' && d->filename[0] != QFS_DIRENT_CONT;
+}
+
+static int find_file(const image_t *img, const char *name) {
+    // First entry with this name, as the CLI tools pick it
+    for (int i = 0; i < img->sb.total_direntries; i++) {
+        if (is_file_entry(&img->dir[i]) &&
+            strncmp(img->dir[i].filename, name, sizeof(img->dir[i].filename)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int find_free_entries(const image_t *img, uint32_t count) {
+    uint32_t run = 0;
+    for (int i = 0; i < img->sb.total_direntries; i++) {
+        run = img->dir[i].filename[0] == '\0' ? run + 1 : 0;
+        if (run == count)
+            return i + 1 - (int)count;
+    }
+    return -1;
+}
+
+static void drop_dedup_index(const image_t *img) {
+    // write_file rebuilds the index when it is missing
+    if (!(img->sb.features & QFS_FEAT_DEDUP))
+        return;
+    char qdx[PATH_MAX + 8];
+    snprintf(qdx, sizeof(qdx), "%s.qdx", img->path);
+    unlink(qdx);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Operations                                                              */
+/* ---------------------------------------------------------------------- */
+
+typedef struct reply {
+    uint8_t  *buf;
+    uint32_t  len;
+} reply_t;
+
+static int reply_alloc(reply_t *r, uint32_t len) {
+    r->buf = malloc(len ? len : 1);
+    r->len = len;
+    return r->buf ? QFSD_OK : QFSD_NOMEM;
+}
+
+static int op_write(image_t *img, const char *name, const uint8_t *data, uint32_t size,
+                    reply_t *r) {
+    superblock_t *sb = &img->sb;
+    uint32_t bpb = sb->bytes_per_block;
+    uint32_t data_per_block = qfs_data_per_block(sb);
+
+    direntry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.filename, name, sizeof(entry.filename) - 1);
+    entry.file_size = size;
+    entry.starting_block = 0xFFFF;
+    if (entry.filename[0] == '\0' || entry.filename[0] == QFS_DIRENT_CONT)
+        return QFSD_PROTO;
+
+    // Small files on packed images live in the directory
+    if ((sb->features & QFS_FEAT_PACK) && size <= QFS_INLINE_MAX) {
+        uint32_t slots = qfs_inline_slots(size);
+        int idx = sb->available_direntries > slots ? find_free_entries(img, 1 + slots) : -1;
+        if (idx >= 0) {
+            direntry_t staged[1 + QFS_INLINE_MAX_SLOTS];
+            superblock_t sb_new = *sb;
+            entry.permissions = QFS_PERM_INLINE;
+            staged[0] = entry;
+            for (uint32_t k = 0; k < slots; k++) {
+                uint8_t *record = (uint8_t *)&staged[1 + k];
+                uint32_t offset = k * QFS_INLINE_PER_SLOT;
+                uint32_t n = size - offset;
+                if (n > QFS_INLINE_PER_SLOT)
+                    n = QFS_INLINE_PER_SLOT;
+                memset(record, 0, sizeof(direntry_t));
+                record[0] = QFS_DIRENT_CONT;
+                memcpy(record + 1, data + offset, n);
+            }
+            sb_new.available_direntries -= 1 + slots;
+            if (commit_entries(img, idx, staged, 1 + slots, &sb_new) != QFSD_OK)
+                return QFSD_IO;
+            drop_dedup_index(img);
+            if (reply_alloc(r, sizeof(entry)) != QFSD_OK)
+                return QFSD_NOMEM;
+            memcpy(r->buf, &entry, sizeof(entry));
+            return QFSD_OK;
+        }
+    }
+
+    uint32_t blocks_needed = (size + data_per_block - 1) / data_per_block;
+    if (blocks_needed == 0)
+        blocks_needed = 1;
+    if (sb->available_blocks < blocks_needed || sb->available_direntries == 0)
+        return QFSD_NOSPACE;
+    int idx = find_free_entries(img, 1);
+    if (idx < 0)
+        return QFSD_NOSPACE;
+
+    // First fit from the start of the data region, as write_file allocates
+    uint16_t *blocks = malloc(sizeof(uint16_t) * blocks_needed);
+    if (!blocks)
+        return QFSD_NOMEM;
+    uint32_t found = 0;
+    uint32_t words = ((uint32_t)sb->total_blocks + 63) / 64;
+    for (uint32_t w = 0; w < words && found < blocks_needed; w++) {
+        uint64_t bits = img->freemap[w];
+        while (bits && found < blocks_needed) {
+            uint32_t b = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (b < sb->total_blocks)
+                blocks[found++] = (uint16_t)b;
+        }
+    }
+    if (found < blocks_needed) {
+        free(blocks);
+        return QFSD_NOSPACE;
+    }
+    qfs_gen_mark_image(img->path, blocks, blocks_needed);
+
+    // Frame the blocks and write each run of consecutive ones at once
+    for (uint32_t i = 0; i < blocks_needed; ) {
+        uint32_t n = 1;
+        while (i + n < blocks_needed && n < QFSD_WRITE_RUN &&
+               blocks[i + n] == blocks[i] + n)
+            n++;
+
+        uint16_t next[QFSD_WRITE_RUN];
+        size_t bytes = 0;
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t offset = (i + k) * data_per_block;
+            uint32_t have = size > offset ? size - offset : 0;
+            if (have > data_per_block)
+                have = data_per_block;
+            memcpy(img->scratch + (size_t)k * bpb + 1, data + offset, have);
+            next[k] = (i + k + 1 < blocks_needed) ? blocks[i + k + 1] : 0xFFFF;
+            bytes += have;
+        }
+        img->kern.frame(&img->kern, img->scratch, n, bytes, next);
+
+        if (qfs_io_full(img->fd, 1, img->scratch, (size_t)n * bpb,
+                        block_offset(img, blocks[i])) != (ssize_t)n * bpb) {
+            release_blocks(img, blocks, i + n);
+            free(blocks);
+            return QFSD_IO;
+        }
+        for (uint32_t k = 0; k < n; k++)
+            cache_insert(&img->cache, blocks[i + k], img->scratch + (size_t)k * bpb);
+        i += n;
+    }
+
+    // The blocks stay free in the free map until the entry is on disk
+    superblock_t sb_new = *sb;
+    sb_new.available_blocks -= blocks_needed;
+    sb_new.available_direntries--;
+    entry.starting_block = blocks[0];
+    if (commit_entries(img, idx, &entry, 1, &sb_new) != QFSD_OK) {
+        release_blocks(img, blocks, blocks_needed);
+        free(blocks);
+        return QFSD_IO;
+    }
+    for (uint32_t i = 0; i < blocks_needed; i++)
+        set_free(img, blocks[i], 0);
+    drop_map(img, idx);
+    img->maps[idx] = blocks;
+    img->map_len[idx] = blocks_needed;
+    drop_dedup_index(img);
+
+    if (reply_alloc(r, sizeof(entry)) != QFSD_OK)
+        return QFSD_NOMEM;
+    memcpy(r->buf, &entry, sizeof(entry));
+    return QFSD_OK;
+}
+
+static int op_read(image_t *img, const char *name, reply_t *r) {
+    int idx = find_file(img, name);
+    if (idx < 0)
+        return QFSD_NOENT;
+
+    const direntry_t *d = &img->dir[idx];
+    uint32_t remaining = d->file_size;
+    if (reply_alloc(r, remaining) != QFSD_OK)
+        return QFSD_NOMEM;
+    uint8_t *out = r->buf;
+
+    if (d->permissions & QFS_PERM_INLINE) {
+        for (uint32_t k = 0; remaining > 0; k++) {
+            const uint8_t *record = (const uint8_t *)&img->dir[idx + 1 + k];
+            uint32_t chunk = remaining > QFS_INLINE_PER_SLOT ? QFS_INLINE_PER_SLOT : remaining;
+            if (idx + 1 + k >= img->sb.total_direntries || record[0] != QFS_DIRENT_CONT)
+                return QFSD_IO;
+            memcpy(out, record + 1, chunk);
+            out += chunk;
+            remaining -= chunk;
+        }
+        return QFSD_OK;
+    }
+
+    const uint16_t *map;
+    uint32_t len;
+    int rc = image_map(img, idx, &map, &len);
+    if (rc != QFSD_OK)
+        return rc;
+
+    uint32_t data_per_block = qfs_data_per_block(&img->sb);
+    for (uint32_t i = 0; i < len && remaining > 0; i++) {
+        const uint8_t *block = image_block(img, map[i]);
+        if (!block)
+            return QFSD_IO;
+        if (!img->kern.verify(&img->kern, block))
+            return QFSD_CHECKSUM;
+
+        if ((d->permissions & QFS_PERM_TAIL) && remaining < data_per_block) {
+            const uint8_t *slice;
+            uint16_t slice_len;
+            if (qfs_tail_find(&img->sb, block, (uint8_t)idx, &slice, &slice_len) != 0 ||
+                slice_len != remaining)
+                return QFSD_IO;
+            memcpy(out, slice, slice_len);
+            return QFSD_OK;
+        }
+
+        uint32_t chunk = remaining > data_per_block ? data_per_block : remaining;
+        memcpy(out, block + 1, chunk);
+        out += chunk;
+        remaining -= chunk;
+    }
+    return remaining ? QFSD_IO : QFSD_OK;
+}
+
+static int cmp_block(const void *a, const void *b) {
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+static int op_delete(image_t *img, const char *name) {
+    superblock_t *sb = &img->sb;
+    uint32_t bpb = sb->bytes_per_block;
+    int idx = find_file(img, name);
+    if (idx < 0)
+        return QFSD_NOENT;
+
+    const direntry_t *d = &img->dir[idx];
+    uint32_t entries = 1;
+    if (d->permissions & QFS_PERM_INLINE)
+        entries += qfs_inline_slots(d->file_size);
+    superblock_t sb_new = *sb;
+
+    const uint16_t *map;
+    uint32_t len;
+    int rc = image_map(img, idx, &map, &len);
+    if (rc != QFSD_OK)
+        return rc;
+    qfs_gen_mark_image(img->path, map, len);
+
+    uint16_t *freed = malloc(sizeof(uint16_t) * (len ? len : 1));
+    if (!freed)
+        return QFSD_NOMEM;
+    uint32_t nfreed = 0;
+
+    // Drop this file's reference to each block; a packed tail is removed
+    // from its tail block instead (see delete_file.c)
+    for (uint32_t i = 0; i < len; i++) {
+        uint16_t b = map[i];
+        const uint8_t *block = image_block(img, b);
+        if (!block) {
+            free(freed);
+            return QFSD_IO;
+        }
+
+        if ((d->permissions & QFS_PERM_TAIL) && i + 1 == len) {
+            memcpy(img->scratch, block, bpb);
+            qfs_tail_rebuild(sb, img->scratch, idx, 0, NULL, 0);
+            if (img->scratch[0] == 0x00) {
+                freed[nfreed++] = b;
+                if (b == sb->tail_block)
+                    sb_new.tail_block = 0xFFFF;
+                continue;
+            }
+            if (qfs_io_full(img->fd, 1, img->scratch, bpb, block_offset(img, b)) != (ssize_t)bpb) {
+                free(freed);
+                return QFSD_IO;
+            }
+            cache_insert(&img->cache, b, img->scratch);
+            continue;
+        }
+
+        // Already free on a live chain: damaged image, credit nothing
+        if (block[0] == 0x00) {
+            fprintf(stderr, "%s: block %u of \"%s\" is already marked free.\n", img->path, b, name);
+            continue;
+        }
+        uint8_t refs = block[0] - 1;
+        if (refs == 0x00) {
+            freed[nfreed++] = b;
+            continue;
+        }
+        if (qfs_io_full(img->fd, 1, &refs, 1, block_offset(img, b)) != 1) {
+            free(freed);
+            return QFSD_IO;
+        }
+        cache_peek(&img->cache, b)[0] = refs;
+    }
+
+    // Release the freed blocks: punch them out of sparse images, clear
+    // their busy bytes otherwise (or where punching fails)
+    qsort(freed, nfreed, sizeof(uint16_t), cmp_block);
+    for (uint32_t i = 0; i < nfreed; ) {
+        uint32_t n = 1;
+        while (i + n < nfreed && freed[i + n] == freed[i] + n)
+            n++;
+
+        int punched = (sb->features & QFS_FEAT_SPARSE) &&
+                      qfs_io_punch(img->fd, block_offset(img, freed[i]), (off_t)n * bpb) == 0;
+        for (uint32_t k = 0; k < n; k++) {
+            uint16_t b = freed[i + k];
+            uint8_t zero = 0x00;
+            if (!punched && qfs_io_full(img->fd, 1, &zero, 1, block_offset(img, b)) != 1) {
+                free(freed);
+                return QFSD_IO;
+            }
+            uint8_t *cached = cache_peek(&img->cache, b);
+            if (cached) {
+                if (punched)
+                    memset(cached, 0, bpb);
+                else
+                    cached[0] = 0x00;
+            }
+        }
+        i += n;
+    }
+
+    // The released blocks only become free for new files once the entry
+    // is gone from disk
+    direntry_t cleared[1 + QFS_INLINE_MAX_SLOTS];
+    memset(cleared, 0, sizeof(direntry_t) * entries);
+    sb_new.available_blocks += nfreed;
+    sb_new.available_direntries += entries;
+    if (commit_entries(img, idx, cleared, entries, &sb_new) != QFSD_OK) {
+        free(freed);
+        return QFSD_IO;
+    }
+    for (uint32_t i = 0; i < nfreed; i++)
+        set_free(img, freed[i], 1);
+    free(freed);
+    drop_map(img, idx);
+    drop_dedup_index(img);
+    return QFSD_OK;
+}
+
+static int op_list(image_t *img, reply_t *r) {
+    uint32_t files = 0;
+    for (int i = 0; i < img->sb.total_direntries; i++)
+        files += is_file_entry(&img->dir[i]);
+
+    if (reply_alloc(r, sizeof(superblock_t) + files * sizeof(direntry_t)) != QFSD_OK)
+        return QFSD_NOMEM;
+    memcpy(r->buf, &img->sb, sizeof(superblock_t));
+    uint8_t *out = r->buf + sizeof(superblock_t);
+    for (int i = 0; i < img->sb.total_direntries; i++) {
+        if (is_file_entry(&img->dir[i])) {
+            memcpy(out, &img->dir[i], sizeof(direntry_t));
+            out += sizeof(direntry_t);
+        }
+    }
+    return QFSD_OK;
+}
+
+static int op_stat(image_t *img, const char *name, reply_t *r) {
+    if (name[0] == '\0') {
+        if (reply_alloc(r, sizeof(superblock_t)) != QFSD_OK)
+            return QFSD_NOMEM;
+        memcpy(r->buf, &img->sb, sizeof(superblock_t));
+        return QFSD_OK;
+    }
+
+    int idx = find_file(img, name);
+    if (idx < 0)
+        return QFSD_NOENT;
+    if (reply_alloc(r, sizeof(direntry_t)) != QFSD_OK)
+        return QFSD_NOMEM;
+    memcpy(r->buf, &img->dir[idx], sizeof(direntry_t));
+    return QFSD_OK;
+}
+
+static int dispatch(const qfsd_hdr_t *hdr, const uint8_t *body, reply_t *r) {
+    // body holds the two strings and the payload; both strings must be
+    // terminated inside name_len
+    const char *image_path = (const char *)body;
+    const char *end = image_path + hdr->name_len;
+    const char *name = memchr(image_path, '\0', hdr->name_len);
+    if (!name)
+        return QFSD_PROTO;
+    name++;
+    if (!memchr(name, '\0', end - name))
+        return QFSD_PROTO;
+    const uint8_t *payload = body + hdr->name_len;
+
+    image_t *img = find_image(image_path);
+    if (!img)
+        return QFSD_NOIMAGE;
+
+    uint64_t start_ns = trace_fd >= 0 ? qfs_trace_now() : 0;
+    uint32_t size = 0;
+    int status;
+    switch (hdr->op) {
+    case QFSD_OP_WRITE:
+        size = hdr->len;
+        status = op_write(img, name, payload, hdr->len, r);
+        break;
+    case QFSD_OP_READ:
+        status = op_read(img, name, r);
+        size = r->len;
+        break;
+    case QFSD_OP_DELETE: {
+        int idx = find_file(img, name);
+        size = idx >= 0 ? img->dir[idx].file_size : 0;
+        status = op_delete(img, name);
+        break;
+    }
+    case QFSD_OP_LIST:
+        status = op_list(img, r);
+        break;
+    case QFSD_OP_STAT:
+        status = op_stat(img, name, r);
+        break;
+    default:
+        return QFSD_PROTO;
+    }
+
+    // QFSD_OP_* and QFS_TRACE_* share their numbering
+    qfs_trace_append(trace_fd, hdr->op, name, size, status, start_ns);
+    return status;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Connections                                                             */
+/* ---------------------------------------------------------------------- */
+
+typedef struct client {
+    int      fd;
+    uint8_t *in;                  // received, not yet executed
+    size_t   in_len, in_cap;
+    int      gathering;           // a request's pieces are being joined in part
+    qfsd_hdr_t part_hdr;          // its first piece's header, len summed
+    uint8_t *part;                // its names, then the payload so far
+    size_t   part_len, part_cap;
+    int      part_status;         // QFSD_OK, or the error to answer it with
+    uint8_t *out;                 // replies not yet sent, from out_off
+    size_t   out_off, out_len, out_cap;
+    int      eof;                 // client has shut down its sending side
+} client_t;
+
+static client_t clients[QFSD_MAX_CLIENTS];
+static int client_count;
+
+static int buf_reserve(uint8_t **buf, size_t *cap, size_t need) {
+    if (need <= *cap)
+        return 0;
+    size_t cap2 = *cap ? *cap : QFSD_RECV_CHUNK;
+    while (cap2 < need)
+        cap2 *= 2;
+    uint8_t *grown = realloc(*buf, cap2);
+    if (!grown)
+        return -1;
+    *buf = grown;
+    *cap = cap2;
+    return 0;
+}
+
+static int client_queue_reply(client_t *c, const qfsd_hdr_t *req, int status,
+                              const reply_t *r) {
+    // A payload over QFSD_MAX_PAYLOAD goes out in pieces
+    uint32_t len = status == QFSD_OK ? r->len : 0;
+    uint32_t pieces = len ? (len + QFSD_MAX_PAYLOAD - 1) / QFSD_MAX_PAYLOAD : 1;
+
+    if (c->out_off > 0 && c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+    if (buf_reserve(&c->out, &c->out_cap,
+                    c->out_len + (size_t)pieces * sizeof(qfsd_hdr_t) + len) != 0)
+        return -1;
+    const uint8_t *p = r->buf;
+    do {
+        uint32_t n = len > QFSD_MAX_PAYLOAD ? QFSD_MAX_PAYLOAD : len;
+        len -= n;
+        qfsd_hdr_t hdr = { req->op, (uint8_t)(status | (len ? QFSD_MORE : 0)), 0, req->id, n };
+        memcpy(c->out + c->out_len, &hdr, sizeof(hdr));
+        if (n)
+            memcpy(c->out + c->out_len + sizeof(hdr), p, n);
+        c->out_len += sizeof(hdr) + n;
+        p += n;
+    } while (len > 0);
+    return 0;
+}
+
+static void client_gather(client_t *c, const qfsd_hdr_t *hdr, const uint8_t *body) {
+    // Add one piece of a request to the ones received before it. Its
+    // names are kept from the first piece; running out of room or memory
+    // is answered once the last piece is in.
+    if (!c->gathering) {
+        c->gathering = 1;
+        c->part_hdr = *hdr;
+        c->part_hdr.len = 0;
+        c->part_len = 0;
+        c->part_status = QFSD_OK;
+        if (buf_reserve(&c->part, &c->part_cap, hdr->name_len) != 0) {
+            c->part_status = QFSD_NOMEM;
+            return;
+        }
+        memcpy(c->part, body, hdr->name_len);
+        c->part_len = hdr->name_len;
+    }
+    if (c->part_status != QFSD_OK)
+        return;
+    if ((uint64_t)c->part_hdr.len + hdr->len > UINT32_MAX) {
+        c->part_status = QFSD_NOSPACE;
+        return;
+    }
+    if (buf_reserve(&c->part, &c->part_cap, c->part_len + hdr->len) != 0) {
+        c->part_status = QFSD_NOMEM;
+        return;
+    }
+    memcpy(c->part + c->part_len, body + hdr->name_len, hdr->len);
+    c->part_len += hdr->len;
+    c->part_hdr.len += hdr->len;
+}
+
+// Execute every complete request received so far. Returns -1 to drop the
+// client (malformed framing or out of memory).
+static int client_execute(client_t *c) {
+    size_t pos = 0;
+    while (c->in_len - pos >= sizeof(qfsd_hdr_t)) {
+        qfsd_hdr_t hdr;
+        memcpy(&hdr, c->in + pos, sizeof(hdr));
+        if (hdr.name_len < 2 || hdr.name_len > QFSD_MAX_NAMES || hdr.len > QFSD_MAX_PAYLOAD)
+            return -1;
+        size_t total = sizeof(hdr) + hdr.name_len + hdr.len;
+        if (c->in_len - pos < total)
+            break;
+        const uint8_t *body = c->in + pos + sizeof(hdr);
+        pos += total;
+
+        // A request in pieces is executed once its last piece is in
+        if (c->gathering && (hdr.op != c->part_hdr.op || hdr.id != c->part_hdr.id))
+            return -1;
+        if (c->gathering || (hdr.status & QFSD_MORE)) {
+            client_gather(c, &hdr, body);
+            if (hdr.status & QFSD_MORE)
+                continue;
+            hdr = c->part_hdr;
+            body = c->part;
+        }
+
+        reply_t r = { NULL, 0 };
+        int status = c->gathering && c->part_status != QFSD_OK
+                   ? c->part_status : dispatch(&hdr, body, &r);
+        int queued = client_queue_reply(c, &hdr, status, &r);
+        free(r.buf);
+        if (c->gathering) {
+            // Do not hold on to a large payload between requests
+            c->gathering = 0;
+            free(c->part);
+            c->part = NULL;
+            c->part_len = c->part_cap = 0;
+        }
+        if (queued != 0)
+            return -1;
+    }
+
+    if (pos > 0) {
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+    return 0;
+}
+
+static int client_recv(client_t *c) {
+    for (;;) {
+        if (buf_reserve(&c->in, &c->in_cap, c->in_len + QFSD_RECV_CHUNK) != 0)
+            return -1;
+        ssize_t r = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (r < 0)
+            return -1;
+        if (r == 0) {
+            c->eof = 1;           // answer what was sent before hanging up
+            return 0;
+        }
+        c->in_len += r;
+        if ((size_t)r < QFSD_RECV_CHUNK)
+            return 0;
+    }
+}
+
+static int client_send(client_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t r = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (r <= 0)
+            return -1;
+        c->out_off += r;
+    }
+    c->out_off = c->out_len = 0;
+    return 0;
+}
+
+static void client_drop(int i) {
+    close(clients[i].fd);
+    free(clients[i].in);
+    free(clients[i].out);
+    free(clients[i].part);
+    clients[i] = clients[--client_count];
+}
+
+int main(int argc, char *argv[]) {
+
+    const char *socket_path = getenv(QFSD_SOCKET_ENV);
+    if (!socket_path || !*socket_path)
+        socket_path = QFSD_DEFAULT_SOCKET;
+    uint32_t cache_blocks = QFSD_DEFAULT_CACHE;
+
+    int argi = 1;
+    while (argi + 1 < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-s") == 0) {
+            socket_path = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-c") == 0) {
+            cache_blocks = (uint32_t)strtoul(argv[argi + 1], NULL, 10);
+        } else {
+            break;
+        }
+        argi += 2;
+    }
+
+    if (argi >= argc || argc - argi > QFSD_MAX_IMAGES) {
+        fprintf(stderr, "Usage: %s [-s <socket>] [-c <cache blocks>] <disk image file> [...]\n",
+                argv[0]);
+        return 1;
+    }
+
+    qfs_crc32c_init();
+    trace_fd = qfs_trace_open();
+    for (; argi < argc; argi++) {
+        if (image_open(&images[image_count], argv[argi], cache_blocks) != 0) {
+            image_close(&images[image_count]);
+            while (image_count > 0)
+                image_close(&images[--image_count]);
+            return 2;
+        }
+        image_count++;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 3;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return 3;
+    }
+
+    // Replace a stale socket, but not one a running daemon still answers on
+    if (connect(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A daemon is already listening on %s\n", socket_path);
+        close(lfd);
+        return 3;
+    }
+    close(lfd);
+    unlink(socket_path);
+
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(lfd, 64) != 0) {
+        perror("bind");
+        return 3;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("qfsd: serving %d image(s) on %s\n", image_count, socket_path);
+    fflush(stdout);
+
+    struct pollfd pfd[QFSD_MAX_CLIENTS + 1];
+    while (!stop) {
+        pfd[0].fd = lfd;
+        pfd[0].events = client_count < QFSD_MAX_CLIENTS ? POLLIN : 0;
+        for (int i = 0; i < client_count; i++) {
+            client_t *c = &clients[i];
+            pfd[i + 1].fd = c->fd;
+            pfd[i + 1].events = 0;
+            // Stop reading from a client that is not collecting its replies
+            if (!c->eof && c->out_len - c->out_off < QFSD_OUT_HIGH)
+                pfd[i + 1].events |= POLLIN;
+            if (c->out_off < c->out_len)
+                pfd[i + 1].events |= POLLOUT;
+        }
+
+        int nfds = client_count + 1;
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        // Walk the clients backwards so that dropping one does not skip another
+        for (int i = nfds - 2; i >= 0; i--) {
+            short ev = pfd[i + 1].revents;
+            if (!ev)
+                continue;
+            client_t *c = &clients[i];
+            int fail = 0;
+            if (ev & POLLIN)
+                fail = client_recv(c) != 0;
+            if (!fail)
+                fail = client_execute(c) != 0;
+            if (!fail)
+                fail = client_send(c) != 0;
+            if (fail || (ev & (POLLERR | POLLNVAL)) ||
+                ((c->eof || (ev & POLLHUP)) && c->out_off == c->out_len))
+                client_drop(i);
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd >= 0) {
+                memset(&clients[client_count], 0, sizeof(client_t));
+                clients[client_count++].fd = cfd;
+            }
+        }
+    }
+
+    while (client_count > 0)
+        client_drop(client_count - 1);
+    close(lfd);
+    unlink(socket_path);
+    for (int i = 0; i < image_count; i++)
+        image_close(&images[i]);
+    if (trace_fd >= 0)
+        close(trace_fd);
+    return 0;
+}
@@ -0,0 +1,344 @@
+/*
+**
+** Wire protocol of the qfsd daemon (see qfsd.c) and the client side used by
+** the CLI tools.
+**
+** Every request and reply is a fixed 12-byte header followed by its body:
+**
+**   request: [header][image path\0][file name\0][payload]
+**   reply:   [header][payload]
+**
+** name_len counts the two NUL-terminated strings, len the payload. The
+** image path is absolute, so the daemon can match it against the images
+** it serves whatever the client's working directory. A reply echoes the
+** request's op and id, with status set to one of the QFSD_* codes below.
+**
+** A payload longer than QFSD_MAX_PAYLOAD travels as a series of pieces:
+** every piece but the last has QFSD_MORE set in its status byte, and the
+** pieces of a request repeat its op, id and names. The receiver joins the
+** pieces; a request is only executed, and a reply only returned, once its
+** last piece has arrived. The whole payload is still limited to what a
+** file can hold (4 GiB).
+**
+**   QFSD_OP_WRITE   payload: file contents     reply: the new direntry_t
+**   QFSD_OP_READ    payload: none              reply: file contents
+**   QFSD_OP_DELETE  payload: none              reply: none
+**   QFSD_OP_LIST    name "", payload: none     reply: superblock_t, then a
+**                                              direntry_t per file
+**   QFSD_OP_STAT    payload: none              reply: the file's direntry_t,
+**                                              or superblock_t for name ""
+**
+** A client may send any number of requests before reading the replies;
+** each connection's requests are executed and answered in order.
+**
+** The CLI tools become thin clients when QFSD_SOCKET names the daemon's
+** socket. qfsd_call() returns QFSD_NODAEMON when QFSD_SOCKET is unset or
+** nothing listens on it, or QFSD_NOIMAGE when the daemon does not serve the
+** image, and only then do the tools operate on the image file directly.
+** Any other failure (QFSD_FAILED) is an error: the request may already have
+** been executed. Direct access takes the lock qfsd holds on the images it
+** serves (qfsd_lock_image()), so a tool without QFSD_SOCKET set cannot
+** change an image under the daemon. The lock is not waited for: any number
+** of tools may read an image at once, but a tool that finds the image
+** locked against it (by qfsd, or by another tool writing it, or reading it
+** while this one writes) refuses to run instead of blocking.
+**
+** Usage: #include "qfsd_proto.h"
+**
+*/
+
+#ifndef QFSD_PROTO_H
+#define QFSD_PROTO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define QFSD_SOCKET_ENV   "QFSD_SOCKET"
+
+#define QFSD_OP_WRITE     1
+#define QFSD_OP_READ      2
+#define QFSD_OP_DELETE    3
+#define QFSD_OP_LIST      4
+#define QFSD_OP_STAT      5
+
+#define QFSD_OK           0
+#define QFSD_NOIMAGE      1       // image not served by this daemon
+#define QFSD_NOENT        2       // no such file
+#define QFSD_NOSPACE      3       // no free blocks or directory entries
+#define QFSD_IO           4       // error reading or writing the image
+#define QFSD_CHECKSUM     5       // block failed its CRC32C check
+#define QFSD_PROTO        6       // malformed request
+#define QFSD_NOMEM        7
+
+#define QFSD_MORE         0x80    // status flag: the payload continues in the next piece
+
+// Returned by qfsd_connect() and qfsd_call() instead of a status
+#define QFSD_NODAEMON     (-1)    // no daemon to ask: operate on the image directly
+#define QFSD_FAILED       (-2)    // the exchange with the daemon failed (errno set)
+
+#define QFSD_MAX_NAMES    (PATH_MAX + 32)
+#define QFSD_MAX_PAYLOAD  (64u << 20)   // payload bytes per piece
+#define QFSD_STREAM_PIECE (1u << 20)    // input bytes sent per piece by qfsd_call_fd()
+#define QFSD_TO_EOF       UINT64_MAX    // qfsd_call_fd(): send everything up to end of input
+
+typedef struct __attribute__((packed)) qfsd_hdr {
+    uint8_t  op;                  // QFSD_OP_*
+    uint8_t  status;              // QFSD_* in replies, plus QFSD_MORE in both
+    uint16_t name_len;            // bytes of image path and file name
+    uint32_t id;                  // chosen by the client, echoed in the reply
+    uint32_t len;                 // payload bytes
+} qfsd_hdr_t;
+
+static inline int qfsd_io_all(int fd, int write, void *buf, size_t len) {
+    // Send or receive exactly len bytes on a blocking socket.
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t r = write ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+// Connect to the daemon named by QFSD_SOCKET. Returns the socket,
+// QFSD_NODAEMON if QFSD_SOCKET is unset or nothing listens on it, or
+// QFSD_FAILED on any other error.
+static inline int qfsd_connect(void) {
+    const char *path = getenv(QFSD_SOCKET_ENV);
+    if (!path || !*path)
+        return QFSD_NODAEMON;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return QFSD_FAILED;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return QFSD_FAILED;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return err == ENOENT || err == ECONNREFUSED ? QFSD_NODAEMON : QFSD_FAILED;
+    }
+    return fd;
+}
+
+// Send one piece of a request; flags is QFSD_MORE unless it is the last.
+static inline int qfsd_send_piece(int fd, uint8_t op, uint8_t flags, uint32_t id,
+                                  const char *image, const char *name,
+                                  const void *payload, uint32_t len) {
+    size_t ilen = strlen(image) + 1;
+    size_t nlen = strlen(name) + 1;
+    if (ilen + nlen > QFSD_MAX_NAMES || len > QFSD_MAX_PAYLOAD) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    qfsd_hdr_t hdr = { op, flags, (uint16_t)(ilen + nlen), id, len };
+    if (qfsd_io_all(fd, 1, &hdr, sizeof(hdr)) != 0 ||
+        qfsd_io_all(fd, 1, (void *)image, ilen) != 0 ||
+        qfsd_io_all(fd, 1, (void *)name, nlen) != 0)
+        return -1;
+    return len ? qfsd_io_all(fd, 1, (void *)payload, len) : 0;
+}
+
+// Queue one request on a connection without waiting for its reply,
+// splitting its payload into pieces.
+static inline int qfsd_send(int fd, uint8_t op, uint32_t id, const char *image,
+                            const char *name, const void *payload, uint32_t len) {
+    const uint8_t *p = payload;
+    for (;;) {
+        uint32_t n = len > QFSD_MAX_PAYLOAD ? QFSD_MAX_PAYLOAD : len;
+        len -= n;
+        if (qfsd_send_piece(fd, op, len ? QFSD_MORE : 0, id, image, name, p, n) != 0)
+            return -1;
+        if (len == 0)
+            return 0;
+        p += n;
+    }
+}
+
+// Receive the next reply, joining its pieces. On success *payload is a
+// malloc'ed buffer of hdr->len bytes (NULL when empty) that the caller
+// frees, and hdr->status no longer carries QFSD_MORE.
+static inline int qfsd_recv(int fd, qfsd_hdr_t *hdr, void **payload) {
+    uint8_t *buf = NULL;
+    size_t total = 0;
+    uint8_t op = 0;
+    uint32_t id = 0;
+    *payload = NULL;
+    for (int first = 1; ; first = 0) {
+        qfsd_hdr_t piece;
+        if (qfsd_io_all(fd, 0, &piece, sizeof(piece)) != 0 ||
+            piece.len > QFSD_MAX_PAYLOAD || total + piece.len > UINT32_MAX ||
+            (!first && (piece.op != op || piece.id != id)))
+            break;
+        op = piece.op;
+        id = piece.id;
+        if (piece.len > 0) {
+            uint8_t *grown = realloc(buf, total + piece.len);
+            if (!grown)
+                break;
+            buf = grown;
+            if (qfsd_io_all(fd, 0, buf + total, piece.len) != 0)
+                break;
+            total += piece.len;
+        }
+        *hdr = piece;
+        if (!(piece.status & QFSD_MORE)) {
+            hdr->len = (uint32_t)total;
+            *payload = buf;
+            return 0;
+        }
+    }
+    free(buf);
+    return -1;
+}
+
+// Run one request against the daemon. Returns the reply's QFSD_* status,
+// QFSD_NODAEMON if there is no daemon to ask, or QFSD_FAILED if the
+// exchange failed. Only QFSD_NODAEMON and QFSD_NOIMAGE mean the caller
+// should operate on the image itself.
+static inline int qfsd_call(const char *image, uint8_t op, const char *name,
+                            const void *payload, uint32_t len,
+                            void **reply, uint32_t *reply_len) {
+    *reply = NULL;
+    *reply_len = 0;
+
+    int fd = qfsd_connect();
+    if (fd < 0)
+        return fd;
+
+    char path[PATH_MAX];
+    if (!realpath(image, path)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return QFSD_FAILED;
+    }
+
+    qfsd_hdr_t hdr;
+    errno = 0;
+    if (qfsd_send(fd, op, 1, path, name, payload, len) != 0 ||
+        qfsd_recv(fd, &hdr, reply) != 0 || hdr.id != 1) {
+        int err = errno ? errno : EPROTO;
+        free(*reply);
+        *reply = NULL;
+        close(fd);
+        errno = err;
+        return QFSD_FAILED;
+    }
+    close(fd);
+    *reply_len = hdr.len;
+    return hdr.status;
+}
+
+// Run one request whose payload is read from the descriptor 'in': 'len'
+// bytes, or everything up to end of input for QFSD_TO_EOF. The input goes
+// out in pieces as it is read, so it is never held in memory whole. Returns
+// as qfsd_call(). If the input cannot be read or ends early, *input_error
+// is set and QFSD_FAILED returned; the connection is closed before the
+// last piece, so the daemon drops the request without executing it.
+static inline int qfsd_call_fd(const char *image, uint8_t op, const char *name,
+                               int in, uint64_t len, int *input_error,
+                               void **reply, uint32_t *reply_len) {
+    *reply = NULL;
+    *reply_len = 0;
+    *input_error = 0;
+
+    int fd = qfsd_connect();
+    if (fd < 0)
+        return fd;
+
+    char path[PATH_MAX];
+    uint8_t *buf = malloc(QFSD_STREAM_PIECE);
+    int ok = buf && realpath(image, path);
+    if (!buf)
+        errno = ENOMEM;
+
+    // Every piece but the last is full, so input of unknown length ends
+    // with a short (possibly empty) piece
+    while (ok) {
+        size_t want = len < QFSD_STREAM_PIECE ? (size_t)len : QFSD_STREAM_PIECE;
+        size_t got = 0;
+        ssize_t r = 1;
+        while (got < want) {
+            r = read(in, buf + got, want - got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        if (r < 0 || (got < want && len != QFSD_TO_EOF)) {
+            if (r == 0)
+                errno = EPIPE;
+            *input_error = 1;
+            ok = 0;
+            break;
+        }
+        int last = len == QFSD_TO_EOF ? got < want : got == len;
+        if (len != QFSD_TO_EOF)
+            len -= got;
+        ok = qfsd_send_piece(fd, op, last ? 0 : QFSD_MORE, 1, path, name, buf, got) == 0;
+        if (last)
+            break;
+    }
+    free(buf);
+
+    qfsd_hdr_t hdr;
+    if (ok) {
+        errno = 0;
+        ok = qfsd_recv(fd, &hdr, reply) == 0 && hdr.id == 1;
+        if (!ok && errno == 0)
+            errno = EPROTO;
+    }
+    if (!ok) {
+        int err = errno;
+        free(*reply);
+        *reply = NULL;
+        close(fd);
+        errno = err;
+        return QFSD_FAILED;
+    }
+    close(fd);
+    *reply_len = hdr.len;
+    return hdr.status;
+}
+
+// Report a QFSD_FAILED exchange about 'image'.
+static inline void qfsd_perror(const char *image) {
+    fprintf(stderr, "%s: request to qfsd failed: %s\n", image, strerror(errno));
+}
+
+// Take the lock qfsd holds on every image it serves, shared to read the
+// image or exclusive to change it, before operating on it directly. Prints
+// a message and returns -1, without waiting, if another process (qfsd or
+// another tool) holds a conflicting lock; the lock goes with the descriptor.
+static inline int qfsd_lock_image(int fd, const char *image, int exclusive) {
+    if (flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == 0 || errno != EWOULDBLOCK)
+        return 0;
+    fprintf(stderr, "%s: image is locked by another process.\n", image);
+    return -1;
+}
+
+#endif
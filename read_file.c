@@ -7,21 +7,106 @@
  *
  * Usage: read_file <filesystem_image> <filename_in_qfs> <output_file>
  *
+ * An output file of "-" writes the contents to standard output, so a file
+ * can be piped out of an image without staging a copy on disk.
+ *
  * This program opens a QFS filesystem image, locates the specified file in the
  * directory table, follows its linked data blocks, and writes the recovered
  * contents to a local output file. It supports the QFS block structure where
  * each block contains 510 bytes of data followed by a 2-byte pointer to the
  * next block (0xFFFF indicates the end of file).
+ *
+ * On images formatted with checksums (mkfs_qfs -c) every block's CRC32C is
+ * verified as it is read, and extraction stops at the first damaged block.
+ *
+ * Files stored inline or with a packed tail (mkfs_qfs -p, see qfs_pack.h)
+ * are read from their directory continuation records and tail slice.
+ *
+ * When QFSD_SOCKET is set and the qfsd daemon serves the image, the file is
+ * fetched from the daemon instead (see qfsd_proto.h). With QFS_TRACE set the
+ * read is recorded in an operation trace (see qfs_trace.h).
  */
 
 
+#define _GNU_SOURCE               // O_DIRECT (see qfs_io.h)
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_io.h"
+#include "qfs_pack.h"
+#include "qfs_stream.h"
+#include "qfsd_proto.h"
+#include "qfs_trace.h"
 
-int main(int argc, char *argv[]) {
+// The output stream: standard output for "-", otherwise the named file.
+static FILE *open_output(const char *outfile) {
+    return strcmp(outfile, "-") == 0 ? stdout : fopen(outfile, "wb");
+}
+
+// Returns 0, or EOF if buffered output could not be written.
+static int close_output(FILE *out) {
+    if (out == stdout)
+        return fflush(out);
+    return fclose(out);
+}
+
+static void report_extracted(const char *target, const char *outfile) {
+    // Standard output carries the data itself
+    if (strcmp(outfile, "-") != 0)
+        printf("Extracted \"%s\" to \"%s\" successfully.\n", target, outfile);
+}
+
+// Returns the exit code, or -1 if the daemon does not serve the image.
+static int read_via_daemon(const char *diskimg, const char *target, const char *outfile) {
+    void *data;
+    uint32_t len;
+    int status = qfsd_call(diskimg, QFSD_OP_READ, target, NULL, 0, &data, &len);
+    if (status == QFSD_NODAEMON || status == QFSD_NOIMAGE)
+        return -1;
+    if (status == QFSD_FAILED) {
+        qfsd_perror(diskimg);
+        return 8;
+    }
+    qfs_trace_skip();
+
+    int rc = 0;
+    if (status == QFSD_OK) {
+        FILE *out = open_output(outfile);
+        if (!out) {
+            perror("fopen(output file)");
+            rc = 6;
+        } else {
+            int failed = len && fwrite(data, len, 1, out) != 1;
+            if (close_output(out) != 0)
+                failed = 1;
+            if (failed) {
+                fprintf(stderr, "Error writing output file\n");
+                rc = 8;
+            }
+        }
+        if (rc == 0)
+            report_extracted(target, outfile);
+    } else if (status == QFSD_NOENT) {
+        fprintf(stderr, "File \"%s\" not found in disk image.\n", target);
+        rc = 5;
+    } else if (status == QFSD_CHECKSUM) {
+        fprintf(stderr, "Checksum mismatch in \"%s\"\n", target);
+        rc = 9;
+    } else if (status == QFSD_NOMEM) {
+        fprintf(stderr, "Memory allocation failed\n");
+        rc = 7;
+    } else {
+        fprintf(stderr, "Error reading \"%s\"\n", target);
+        rc = 8;
+    }
+    free(data);
+    return rc;
+}
+
+static int run(int argc, char *argv[]) {
 
     // ---------------------------------------------------
     // Validate arguments
@@ -35,6 +120,10 @@ int main(int argc, char *argv[]) {
     const char *target  = argv[2];
     const char *outfile = argv[3];
 
+    int forwarded = read_via_daemon(diskimg, target, outfile);
+    if (forwarded >= 0)
+        return forwarded;
+
     // ---------------------------------------------------
     // Open disk image
     // ---------------------------------------------------
@@ -43,6 +132,10 @@ int main(int argc, char *argv[]) {
         perror("fopen(disk image)");
         return 2;
     }
+    if (qfsd_lock_image(fileno(fp), diskimg, 0) != 0) {
+        fclose(fp);
+        return 2;
+    }
 
     // ---------------------------------------------------
     // Read superblock
@@ -55,107 +148,128 @@ int main(int argc, char *argv[]) {
     }
 
     // ---------------------------------------------------
-    // Scan directory entries
+    // Read the directory and find the entry
     // ---------------------------------------------------
-    direntry_t dir;
-    int found = 0;
-
-    fseek(fp, sizeof(superblock_t), SEEK_SET);
+    // The whole table is kept so that an inline file's continuation
+    // records can be read from it
+    direntry_t *dir = malloc(sizeof(direntry_t) * (sb.total_direntries ? sb.total_direntries : 1));
+    if (!dir) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(fp);
+        return 7;
+    }
+    if (fread(dir, sizeof(direntry_t), sb.total_direntries, fp) != sb.total_direntries) {
+        fprintf(stderr, "Error reading directory entries\n");
+        free(dir);
+        fclose(fp);
+        return 4;
+    }
 
+    int dir_index = -1;
     for (int i = 0; i < sb.total_direntries; i++) {
-
-        if (fread(&dir, sizeof(direntry_t), 1, fp) != 1) {
-            fprintf(stderr, "Error reading directory entry %d\n", i);
-            fclose(fp);
-            return 4;
-        }
-
-        // Skip empty directory entries
-        if (dir.filename[0] == '\0')
+        // Skip empty directory entries and inline continuation records
+        if (dir[i].filename[0] == '\0' || dir[i].filename[0] == QFS_DIRENT_CONT)
             continue;
-
-        // Check filename match
-        if (strcmp(dir.filename, target) == 0) {
-            found = 1;
+        if (strcmp(dir[i].filename, target) == 0) {
+            dir_index = i;
+            qfs_trace_size(dir[i].file_size);
             break;
         }
     }
 
-    if (!found) {
+    if (dir_index < 0) {
         fprintf(stderr, "File \"%s\" not found in disk image.\n", target);
+        free(dir);
         fclose(fp);
         return 5;
     }
 
     // ---------------------------------------------------
-    // Open output file
+    // Open output file and the image for block reads
     // ---------------------------------------------------
-    FILE *out = fopen(outfile, "wb");
+    FILE *out = open_output(outfile);
     if (!out) {
         perror("fopen(output file)");
+        free(dir);
         fclose(fp);
         return 6;
     }
 
-    // ---------------------------------------------------
-    // Begin block traversal
-    // ---------------------------------------------------
-    uint16_t block = dir.starting_block;
-    uint32_t remaining = dir.file_size;
-
-    // Allocate buffer based on block size
-    uint8_t *buffer = malloc(sb.bytes_per_block);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed\n");
+    // The blocks are read through a second descriptor so that they can
+    // bypass the page cache when QFS_DIRECT is set
+    int io_mode;
+    int fd = qfs_io_open(diskimg, O_RDONLY, &io_mode);
+    if (fd < 0) {
+        perror("open(disk image)");
+        free(dir);
         fclose(fp);
-        fclose(out);
-        return 7;
+        close_output(out);
+        return 2;
     }
 
-    // Amount of actual file data per block
-    uint32_t data_per_block = sb.bytes_per_block - 3;
-
-    while (remaining > 0 && block != 0xFFFF) {
-
-        // Compute block offset in disk image
-        long block_offset =
-            sizeof(superblock_t) +
-            sizeof(direntry_t) * sb.total_direntries +
-            (long)block * sb.bytes_per_block;
-
-        fseek(fp, block_offset, SEEK_SET);
+    qfs_io_t io;
+    qfs_io_init(&io, fd);
+    io.direct = (io_mode == QFS_IO_DIRECT);
 
-        // Read entire block
-        if (fread(buffer, sb.bytes_per_block, 1, fp) != 1) {
+    // ---------------------------------------------------
+    // Copy the file out (see qfs_stream.h); blocks are read ahead
+    // through the async I/O queue and checked against their CRC32C
+    // ---------------------------------------------------
+    uint16_t block = 0xFFFF;
+    int rc = 0;
+    switch (qfs_stream_read(&io, &sb, dir, dir_index, out, &block)) {
+    case 0:
+        break;
+    case QFS_STREAM_ENOMEM:
+        fprintf(stderr, "Memory allocation failed\n");
+        rc = 7;
+        break;
+    case QFS_STREAM_ECRC:
+        fprintf(stderr, "Checksum mismatch in block %u\n", block);
+        rc = 9;
+        break;
+    case QFS_STREAM_ETAIL:
+        fprintf(stderr, "Missing tail for \"%s\" in block %u\n", target, block);
+        rc = 9;
+        break;
+    case QFS_STREAM_EOUTPUT:
+        fprintf(stderr, "Error writing output file\n");
+        rc = 8;
+        break;
+    default:
+        if (dir[dir_index].permissions & QFS_PERM_INLINE)
+            fprintf(stderr, "Error reading directory entry %d\n", dir_index + 1);
+        else if (block == 0xFFFF)
+            fprintf(stderr, "Block chain of \"%s\" ends early\n", target);
+        else
             fprintf(stderr, "Error reading block %u\n", block);
-            free(buffer);
-            fclose(fp);
-            fclose(out);
-            return 8;
-        }
-
-        // Read next block pointer (last two bytes)
-        uint16_t next =
-            buffer[sb.bytes_per_block - 2] |
-            (buffer[sb.bytes_per_block - 1] << 8);
-
-        // Write only file data (skip busy byte)
-        uint32_t chunk =
-            (remaining > data_per_block) ? data_per_block : remaining;
-
-        fwrite(buffer + 1, chunk, 1, out);
-
-        remaining -= chunk;
-        block = next;
+        rc = 8;
+        break;
     }
 
     // ---------------------------------------------------
     // Cleanup
     // ---------------------------------------------------
-    free(buffer);
+    qfs_io_close(&io);
+    qfs_io_release(fd, io_mode, 0, 0);
+    close(fd);
+    free(dir);
     fclose(fp);
-    fclose(out);
+    if (close_output(out) != 0 && rc == 0) {
+        fprintf(stderr, "Error writing output file\n");
+        rc = 8;
+    }
 
-    printf("Extracted \"%s\" to \"%s\" successfully.\n", target, outfile);
+    if (rc != 0)
+        return rc;
+
+    report_extracted(target, outfile);
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    qfs_trace_begin(QFS_TRACE_READ, argc >= 3 ? argv[2] : "");
+    int rc = run(argc, argv);
+    qfs_trace_end(rc);
+    return rc;
+}
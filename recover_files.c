@@ -10,14 +10,25 @@
  * This program opens the specified QFS filesystem image, scans for deleted files,
  * and attempts to recover them by reading their data blocks and writing them to
  * the local filesystem.
+ *
+ * The data region is streamed in large chunks with two reads kept in flight
+ * (see qfs_io.h), so the scan never holds the whole image in memory. With
+ * QFS_DIRECT=1 the chunks are read with O_DIRECT into aligned pool buffers
+ * and the scan leaves the page cache alone. Chunks that are holes in the
+ * image file (free space of a sparse image) are not read at all.
 */
 
+#define _GNU_SOURCE               // O_DIRECT (see qfs_io.h)
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "qfs.h"
+#include "qfs_io.h"
 
 #define DATA_START_OFFSET 8192 // Superblock of 32 bytes plus directory entries of 8160 bytes
+#define SCAN_CHUNK   (1 << 20) // Bytes per read while scanning the data region
+#define SCAN_BUFFERS 2         // Reads kept in flight
 
 int main(int argc, char *argv[]) {
 
@@ -26,9 +37,10 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    FILE *fp = fopen(argv[1], "rb");
-    if (!fp) {
-        perror("fopen");
+    int io_mode;
+    int fd = qfs_io_open(argv[1], O_RDONLY, &io_mode);
+    if (fd < 0) {
+        perror("open");
         return 2;
     }
 
@@ -36,21 +48,38 @@ int main(int argc, char *argv[]) {
     printf("Opened disk image: %s\n", argv[1]);
 #endif
 
+    // Buffers for the scan. Every read goes into an aligned pool buffer so
+    // the same code works with and without O_DIRECT.
+    qfs_pool_t pool;
+    if (qfs_pool_init(&pool, qfs_io_span(SCAN_CHUNK), SCAN_BUFFERS + 1) != 0) {
+        fprintf(stderr, "Error: memory allocation failed.\n");
+        close(fd);
+        return 5;
+    }
+
     // Read the filesystem superblock structure from the beginning of the image.
     // `superblock_t` is defined in `qfs.h` and holds metadata such as the
     // filesystem type, bytes-per-block and number of blocks.
     // A successful read ensures we can interpret the rest of the image.
+    // The superblock is shorter than a direct I/O sector, so it is read via
+    // the enclosing aligned range.
     superblock_t superblock;
-    if (fread(&superblock, sizeof(superblock_t), 1, fp) != 1) {
+    uint8_t *meta = qfs_pool_get(&pool);
+    const uint8_t *sb_bytes = qfs_io_read_span(fd, meta, sizeof(superblock_t), 0);
+    if (!sb_bytes) {
         fprintf(stderr, "Error: failed to read superblock.\n");
-        fclose(fp);
+        qfs_pool_destroy(&pool);
+        close(fd);
         return 3;
     }
+    memcpy(&superblock, sb_bytes, sizeof(superblock_t));
+    qfs_pool_put(&pool, meta);
 
     // Confirm this is a valid QFS filesystem
     if (superblock.fs_type != 0x51) {
         fprintf(stderr, "Error: not a valid QFS image.\n");
-        fclose(fp);
+        qfs_pool_destroy(&pool);
+        close(fd);
         return 4;
     }
 
@@ -61,74 +90,143 @@ int main(int argc, char *argv[]) {
     uint16_t total_blocks = superblock.total_blocks;
     uint32_t data_size = (uint32_t)block_size * total_blocks;
 
-    // Allocate a buffer to hold all data blocks. This simplifies scanning
-    // because we can treat the data region as one contiguous byte array.
-    uint8_t *buffer = malloc(data_size);
-    if (!buffer) {
-        fprintf(stderr, "Error: memory allocation failed.\n");
-        fclose(fp);
-        return 5;
-    }
-
-    // Move the file pointer to the start of the data blocks region. The
-    // superblock and directory area precede this region.
-    fseek(fp, DATA_START_OFFSET, SEEK_SET);
-
-    // Read raw block data
-    if (fread(buffer, 1, data_size, fp) != data_size) {
-        fprintf(stderr, "Error: failed to read data blocks.\n");
-        free(buffer);
-        fclose(fp);
-        return 6;
-    }
-
-    fclose(fp); // No longer need the disk image file
-
     // Scan for JPG signatures
     const uint8_t JPG_START[2] = {0xFF, 0xD8};
     const uint8_t JPG_END[2] = {0xFF, 0xD9};
 
     int writing = 0;       // Whether we are currently writing a discovered JPG
     int file_count = 0;    // Number of recovered JPGs found so far
-    FILE *out_fp = NULL;   // Output file pointer for the current JPG
-
-    // Scan the data region byte-by-byte. We stop at `data_size - 1` because
-    // we often read pairs of bytes (current and next) when checking markers.
-    for (uint32_t i = 0; i < data_size - 1; i++) {
-        // Detect JPH start marker (FFD8)
-        if (!writing && buffer[i] == JPG_START[0] && buffer[i + 1] == JPG_START[1]) {
-            file_count++;
-            char name[64];
-            sprintf(name, "recovered_file_%d.jpg", file_count);
-
-            out = fopen(name, "wb");
-            if (!out) {
-                fprintf(stderr, "Error: could not create output file %s\n", name);
-                free(buffer);
-                return 7;
+    FILE *out = NULL;      // Output file pointer for the current JPG
+    int prev = -1;         // Previous byte of the stream, -1 if already consumed
+
+    // Queue reads for the first chunks. Each read is tagged with its chunk's
+    // buffer slot; completions may arrive in any order, so each is recorded
+    // against its slot and the chunks are scanned in order once done.
+    qfs_io_t io;
+    qfs_io_init(&io, fd);
+
+    uint32_t next_read = 0;      // data-region offset of the next chunk to queue
+    uint32_t scanned = 0;        // data-region offset of the next chunk to scan
+    uint8_t *chunk_buf[SCAN_BUFFERS];
+    int chunk_hole[SCAN_BUFFERS];  // chunk lies entirely in a hole: nothing queued
+    int chunk_done[SCAN_BUFFERS];  // chunk's read has completed
+    ssize_t chunk_res[SCAN_BUFFERS];
+    int rc = 0;
+
+    for (int k = 0; k < SCAN_BUFFERS; k++)
+        chunk_buf[k] = qfs_pool_get(&pool);
+
+    while (scanned < data_size && rc == 0) {
+        // Keep SCAN_BUFFERS reads in flight ahead of the scan
+        while (next_read < data_size && next_read - scanned < (uint32_t)SCAN_BUFFERS * SCAN_CHUNK) {
+            uint32_t len = data_size - next_read;
+            if (len > SCAN_CHUNK)
+                len = SCAN_CHUNK;
+            int k = (next_read / SCAN_CHUNK) % SCAN_BUFFERS;
+            off_t off = DATA_START_OFFSET + (off_t)next_read;
+            chunk_hole[k] = qfs_io_range_is_hole(fd, off, len);
+            // DATA_START_OFFSET and SCAN_CHUNK are both multiples of QFS_IO_ALIGN,
+            // so only the final read needs its length rounded up
+            chunk_done[k] = chunk_hole[k];
+            if (!chunk_hole[k] &&
+                qfs_io_queue(&io, 0, chunk_buf[k], qfs_io_align_up(len), off, k) != 0) {
+                rc = 6;
+                break;
             }
-            writing = 1; // Now writing bytes to the newly created JPG file
+            next_read += len;
+        }
+        if (rc != 0 || qfs_io_submit(&io) != 0) {
+            fprintf(stderr, "Error: failed to read data blocks.\n");
+            rc = 6;
+            break;
         }
-        // Write current byte if inside a JPG
-        if (writing) {
-            fwrite(&buffer[i], 1, 1, out);
+
+        int k = (scanned / SCAN_CHUNK) % SCAN_BUFFERS;
+        uint32_t len = data_size - scanned;
+        if (len > SCAN_CHUNK)
+            len = SCAN_CHUNK;
+
+        // A hole reads as zeros: no marker can start or end inside it, and
+        // a JPG still being written just gets the zeros
+        if (chunk_hole[k]) {
+            if (writing) {
+                uint8_t zeros[4096] = {0};
+                for (uint32_t z = 0; z < len; z += sizeof(zeros))
+                    fwrite(zeros, 1, len - z < sizeof(zeros) ? len - z : sizeof(zeros), out);
+            }
+            prev = 0x00;
+            scanned += len;
+            continue;
         }
 
-        // Check for the JPG end marker while writing. When found, write the
-        // final byte, close the file, and stop writing until a new start
-        // marker is discovered. We increment `i` to skip the second byte of
-        // the end marker because it has already been consumed.
-        if (writing && buffer[i] == JPG_END[0] && buffer[i + 1] == JPG_END[1]) {
-            fwrite(&buffer[i + 1], 1, 1, out); // Write the last byte of the JPG
-            fclose(out);
-            out = NULL;
-            writing = 0; // Finished writing this JPG
-
-            i++; // Advance past the second byte of the end marker
+        while (!chunk_done[k]) {
+            uint64_t tag;
+            ssize_t res;
+            if (qfs_io_wait(&io, &tag, &res) != 0)
+                break;
+            chunk_done[tag] = 1;
+            chunk_res[tag] = res;
+        }
+        if (!chunk_done[k] || chunk_res[k] < (ssize_t)len) {
+            fprintf(stderr, "Error: failed to read data blocks.\n");
+            rc = 6;
+            break;
         }
+        const uint8_t *buffer = chunk_buf[k];
+
+        // Scan the chunk byte-by-byte, pairing each byte with the one before
+        // it (carried over from the previous chunk when needed) to spot the
+        // two-byte markers.
+        uint32_t span = 0;   // start of the bytes to copy to the current JPG
+        for (uint32_t i = 0; i < len; i++) {
+            uint8_t c = buffer[i];
+
+            // Detect JPG start marker (FFD8)
+            if (!writing && prev == JPG_START[0] && c == JPG_START[1]) {
+                file_count++;
+                char name[64];
+                sprintf(name, "recovered_file_%d.jpg", file_count);
+
+                out = fopen(name, "wb");
+                if (!out) {
+                    fprintf(stderr, "Error: could not create output file %s\n", name);
+                    rc = 7;
+                    break;
+                }
+                fputc(JPG_START[0], out);
+                writing = 1; // Now writing bytes to the newly created JPG file
+                span = i;
+            }
+
+            // Check for the JPG end marker while writing. When found, write
+            // everything up to and including it, close the file, and stop
+            // writing until a new start marker is discovered. The end marker
+            // is consumed, so it cannot also begin a new start marker.
+            if (writing && prev == JPG_END[0] && c == JPG_END[1]) {
+                fwrite(buffer + span, 1, i + 1 - span, out);
+                fclose(out);
+                out = NULL;
+                writing = 0; // Finished writing this JPG
+                prev = -1;
+                continue;
+            }
+            prev = c;
+        }
+        if (writing && rc == 0)
+            fwrite(buffer + span, 1, len - span, out);
+
+        qfs_io_release(fd, io_mode, DATA_START_OFFSET + (off_t)scanned, len);
+        scanned += len;
     }
-    free(buffer);
+
+    qfs_io_close(&io);
+    close(fd); // No longer need the disk image file
+    qfs_pool_destroy(&pool);
+    if (out)
+        fclose(out);
+    if (rc != 0)
+        return rc;
 
     printf("Recovered %d file(s).\n", file_count);
     return 0;
-}
\ No newline at end of file
+}
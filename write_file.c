@@ -5,18 +5,77 @@
  *
  * Usage:
  *   ./write_file <disk image file> <file to add>
+ *   ./write_file <disk image file> - <name>
  *
  * Writes a local file into a QFS disk image. The program locates a free
  * directory entry and enough free data blocks, writes the file data across
  * those blocks, links them using the QFS next-block pointer format, and
  * updates the superblock metadata accordingly.
+ *
+ * On images formatted with deduplication (mkfs_qfs -d) every block is
+ * hashed before it is written. Blocks whose full contents (payload and
+ * next pointer) already exist in the image are shared instead of written
+ * again: the existing block's busy byte, which doubles as a reference
+ * count, is incremented. Because the next pointer is part of the contents,
+ * the file is framed from its last block backwards so that identical file
+ * tails and whole duplicate files collapse onto the same chain.
+ *
+ * The hash index is kept next to the image in "<image>.qdx" and is rebuilt
+ * from the data region whenever it is missing or was made for a different
+ * geometry. It is only a hint, maintained by this path alone: qfsd drops
+ * it, while write_file - and qfs_tar -x leave it untouched, so blocks they
+ * write are simply not offered for sharing. Every candidate it yields is
+ * compared with the block's contents before it is shared, so a stale index
+ * costs sharing opportunities but never correctness.
+ *
+ * Free blocks that lie in holes of a sparse image (mkfs_qfs -s) are found
+ * with SEEK_DATA/SEEK_HOLE rather than by reading their busy bytes.
+ *
+ * Without deduplication the file is written through a two-stage pipeline:
+ * the main thread reads the input in large chunks, scattering it straight
+ * into the payload areas of framed blocks held in a small ring of pooled
+ * buffers, while a writer thread writes each run of consecutive blocks to
+ * the image with a single pwrite(). Input and output I/O overlap, so large
+ * files are ingested at the speed of the slower device.
+ *
+ * On packed images (mkfs_qfs -p) files of up to QFS_INLINE_MAX bytes are
+ * stored in directory continuation records instead of data blocks, and
+ * short final partial blocks are packed into a shared tail block (see
+ * qfs_pack.h). Tails are not packed on deduplicated images, where whole
+ * final blocks are what lets duplicate files share their chains.
+ *
+ * With "-" the file is read from standard input, whose length need not be
+ * known in advance: blocks are allocated as the data arrives and the
+ * directory entry is written once the input ends (see qfs_stream.h). Streamed
+ * files are stored as plain block chains, without deduplication or packing.
+ *
+ * When QFSD_SOCKET is set and the qfsd daemon serves the image, the file is
+ * handed to the daemon instead (see qfsd_proto.h). With QFS_TRACE set the
+ * write is recorded in an operation trace (see qfs_trace.h).
+ *
+ * On images tracked for snapshots (see qfs_gen.h) every block the write
+ * changes is stamped with a new generation before it is written.
  */
 
+#define _GNU_SOURCE               // SEEK_DATA/SEEK_HOLE (see qfs_io.h)
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "qfs.h"
+#include "qfs_crc.h"
+#include "qfs_gen.h"
+#include "qfs_io.h"
+#include "qfs_kernels.h"
+#include "qfs_pack.h"
+#include "qfs_stream.h"
+#include "qfsd_proto.h"
+#include "qfs_trace.h"
 
 static const char *basename_simple(const char *path) {
     
@@ -30,6 +89,22 @@ static const char *basename_simple(const char *path) {
     return base;
 }
 
+static int find_free_direntries(FILE *fp, const superblock_t *sb, uint32_t count) {
+    // Return the index of the first run of 'count' consecutive free
+    // directory entries, or -1 if there is none.
+    uint32_t run = 0;
+    fseek(fp, sizeof(superblock_t), SEEK_SET);
+    for (int i = 0; i < sb->total_direntries; i++) {
+        direntry_t d;
+        if (fread(&d, sizeof(direntry_t), 1, fp) != 1)
+            break;
+        run = (d.filename[0] == '\0') ? run + 1 : 0;
+        if (run == count)
+            return i + 1 - (int)count;
+    }
+    return -1;
+}
+
 static long data_region_offset(const superblock_t *sb) {
     // Compute the file-offset where the data region (blocks) begins.
     return (long)sizeof(superblock_t)
@@ -42,173 +117,1013 @@ static long block_offset(const superblock_t *sb, uint16_t block_num) {
          + (long)block_num * sb->bytes_per_block;
 }
 
-int main(int argc, char *argv[]) {
-
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <disk image file> <file to add>\n", argv[0]);
+static int block_is_free(FILE *fp, const superblock_t *sb, qfs_holes_t *holes,
+                         uint16_t block_num) {
+    // A block is free if its busy byte is 0x00. Blocks inside a hole of the
+    // image file read as zeros, so they are free without any I/O.
+    long offset = block_offset(sb, block_num);
+    if (holes && qfs_io_in_hole(holes, offset))
         return 1;
+
+    uint8_t busy;
+    fseek(fp, offset, SEEK_SET);
+    return fread(&busy, 1, 1, fp) == 1 && busy == 0x00;
+}
+
+// ---------------------------------------------------------------------------
+// Deduplication
+// ---------------------------------------------------------------------------
+
+#define QDX_MAGIC "QDX1"
+
+// On-disk header of the hash index file. It is followed by one 64-bit hash
+// per data block (0 = no hash recorded for that block).
+typedef struct qdx_header {
+    char     magic[4];
+    uint16_t total_blocks;
+    uint16_t bytes_per_block;
+} qdx_header_t;
+
+// In-memory hash index: per-block hashes plus an open-addressed table
+// mapping a hash to candidate block numbers. Candidates are always
+// verified against the block contents, so stale entries are harmless.
+typedef struct dedup_index {
+    uint64_t *hashes;        // hash of each block, indexed by block number
+    uint32_t *slots;         // table of block number + 1 (0 = empty)
+    uint32_t  mask;          // table size - 1
+} dedup_index_t;
+
+static uint64_t block_hash(const uint8_t *p, size_t n) {
+    // Hash a block 8 bytes at a time (multiply/rotate mixing with a final
+    // avalanche), so hashing costs little next to the block I/O itself.
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (uint64_t)n;
+    while (n >= 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= 0x87C37B91114253D5ULL;
+        k = (k << 31) | (k >> 33);
+        k *= 0x4CF5AD432745937FULL;
+        h ^= k;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+        p += 8;
+        n -= 8;
     }
+    uint64_t k = 0;
+    for (size_t i = 0; i < n; i++)
+        k |= (uint64_t)p[i] << (8 * i);
+    h ^= k * 0x87C37B91114253D5ULL;
 
-    FILE *fp = fopen(argv[1], "rb+");
-    if (!fp) {
-        perror("fopen");
-        return 2;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;        // 0 is reserved for "no hash"
+}
+
+static void index_insert(dedup_index_t *idx, uint16_t block, uint64_t h) {
+    idx->hashes[block] = h;
+    uint32_t i = (uint32_t)h & idx->mask;
+    while (idx->slots[i] != 0) {
+        if (idx->slots[i] == (uint32_t)block + 1)
+            return;
+        i = (i + 1) & idx->mask;
     }
+    idx->slots[i] = (uint32_t)block + 1;
+}
 
+static void index_path(char *path, size_t len, const char *image) {
+    snprintf(path, len, "%s.qdx", image);
+}
+
+static int index_load(dedup_index_t *idx, FILE *fp, const superblock_t *sb,
+                      const char *image, qfs_holes_t *holes) {
+    // Load the persistent hash index for this image, or rebuild it by
+    // hashing every busy block when the index file is missing or stale.
+    uint32_t size = 1;
+    while (size < 2u * sb->total_blocks)
+        size <<= 1;
+
+    idx->hashes = calloc(sb->total_blocks ? sb->total_blocks : 1, sizeof(uint64_t));
+    idx->slots  = calloc(size, sizeof(uint32_t));
+    idx->mask   = size - 1;
+    if (!idx->hashes || !idx->slots)
+        return -1;
+
+    char path[4096];
+    index_path(path, sizeof(path), image);
+
+    int loaded = 0;
+    FILE *ix = fopen(path, "rb");
+    if (ix) {
+        qdx_header_t hdr;
+        if (fread(&hdr, sizeof(hdr), 1, ix) == 1 &&
+            memcmp(hdr.magic, QDX_MAGIC, 4) == 0 &&
+            hdr.total_blocks == sb->total_blocks &&
+            hdr.bytes_per_block == sb->bytes_per_block &&
+            fread(idx->hashes, sizeof(uint64_t), sb->total_blocks, ix)
+                == sb->total_blocks)
+            loaded = 1;
+        fclose(ix);
+    }
+
+    if (!loaded) {
 #ifdef DEBUG
-    printf("Opened disk image: %s\n", argv[1]);
+        printf("Rebuilding dedup index %s\n", path);
 #endif
+        uint8_t *buffer = malloc(sb->bytes_per_block);
+        if (!buffer)
+            return -1;
+        memset(idx->hashes, 0, sizeof(uint64_t) * sb->total_blocks);
+        for (uint32_t b = 0; b < sb->total_blocks; b++) {
+            if (holes && qfs_io_in_hole(holes, block_offset(sb, b)))
+                continue;
+            fseek(fp, block_offset(sb, b), SEEK_SET);
+            if (fread(buffer, sb->bytes_per_block, 1, fp) != 1)
+                break;
+            if (buffer[0] != 0x00)
+                idx->hashes[b] = block_hash(buffer + 1, sb->bytes_per_block - 1);
+        }
+        free(buffer);
+    }
 
-    // Read and validate superblock
-    superblock_t sb;
-    if (fread(&sb, sizeof(superblock_t), 1, fp) != 1) {
-        fprintf(stderr, "Error reading superblock.\n");
-        fclose(fp);
-        return 3;
+    for (uint32_t b = 0; b < sb->total_blocks; b++) {
+        if (idx->hashes[b])
+            index_insert(idx, (uint16_t)b, idx->hashes[b]);
     }
+    return 0;
+}
 
-    if (sb.fs_type != 0x51) {
-        fprintf(stderr, "Not a valid QFS filesystem.\n");
-        fclose(fp);
-        return 4;
+static void index_save(const dedup_index_t *idx, const superblock_t *sb,
+                       const char *image) {
+    char path[4096];
+    index_path(path, sizeof(path), image);
+
+    FILE *ix = fopen(path, "wb");
+    if (!ix) {
+        perror("fopen(dedup index)");
+        return;
+    }
+    qdx_header_t hdr;
+    memcpy(hdr.magic, QDX_MAGIC, 4);
+    hdr.total_blocks = sb->total_blocks;
+    hdr.bytes_per_block = sb->bytes_per_block;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, ix) == 1 &&
+             fwrite(idx->hashes, sizeof(uint64_t), sb->total_blocks, ix)
+                 == sb->total_blocks;
+    if (fclose(ix) != 0)
+        ok = 0;
+    if (!ok) {
+        // A short index would be trusted by the next load; drop it so
+        // that load rebuilds from the image instead
+        perror("fwrite(dedup index)");
+        unlink(path);
     }
+}
 
-    // Open local file and compute its size
-    FILE *in = fopen(argv[2], "rb");
-    if (!in) {
-        perror("fopen(local file)");
-        fclose(fp);
-        return 5;
+static void index_free(dedup_index_t *idx) {
+    free(idx->hashes);
+    free(idx->slots);
+}
+
+static int write_dedup(FILE *fp, superblock_t *sb, FILE *in,
+                       uint32_t file_size, uint32_t blocks_needed,
+                       const char *image, qfs_holes_t *holes,
+                       uint16_t *starting_block, uint32_t *blocks_used) {
+    // Write the file with block sharing. Returns 0 on success or the
+    // program's exit code on failure; nothing is written to the image
+    // unless the whole file fits, and a failed write is undone before
+    // returning, so the caller leaves the directory untouched.
+    //
+    // Pass 1 frames the blocks from last to first, matching each against
+    // the index (and against blocks planned earlier in this same file)
+    // and reserving a free block only when no match exists.
+    // Pass 2 then writes the new blocks and bumps the shared ones.
+    qfs_kernels_t kern;
+    qfs_kernels_init(&kern, sb);
+    uint32_t bpb = kern.bpb;
+    uint32_t data_per_block = kern.dpb;
+
+    dedup_index_t idx;
+    if (index_load(&idx, fp, sb, image, holes) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        index_free(&idx);
+        return 9;
     }
 
-    fseek(in, 0, SEEK_END);
-    long file_size_long = ftell(in);
-    fseek(in, 0, SEEK_SET);
+    uint16_t *chain  = malloc(sizeof(uint16_t) * blocks_needed);
+    uint8_t  *frames = malloc((size_t)bpb * blocks_needed);  // new blocks, by file position
+    uint8_t  *is_new = calloc(blocks_needed, 1);
+    uint8_t  *planned = calloc(sb->total_blocks ? sb->total_blocks : 1, sizeof(uint8_t));
+    uint32_t *plan_pos = malloc(sizeof(uint32_t) * (sb->total_blocks ? sb->total_blocks : 1));
+    uint8_t  *candidate = malloc(bpb);
+    if (!chain || !frames || !is_new || !planned || !plan_pos || !candidate) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(chain); free(frames); free(is_new); free(planned); free(plan_pos);
+        free(candidate);
+        index_free(&idx);
+        return 9;
+    }
 
-    if (file_size_long < 0) {
-        fprintf(stderr, "Unable to determine file size.\n");
-        fclose(in);
-        fclose(fp);
-        return 6;
+    // Collect the first free blocks up front. They are handed out from the
+    // top down as the file is framed backwards, so the new blocks of a file
+    // still end up in ascending order on disk.
+    uint16_t *free_list = malloc(sizeof(uint16_t) * blocks_needed);
+    uint32_t free_count = 0;
+    if (!free_list) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(chain); free(frames); free(is_new); free(planned); free(plan_pos);
+        free(candidate);
+        index_free(&idx);
+        return 9;
+    }
+    for (uint16_t b = 0; b < sb->total_blocks && free_count < blocks_needed; b++) {
+        if (block_is_free(fp, sb, holes, b))
+            free_list[free_count++] = b;
     }
 
-    // Convert size and compute how many blocks are required.
-    // Each QFS block reserves 1 byte for a busy marker and
-    // 2 bytes for the next-block pointer (little-endian),
-    // so usable payload per block = bytes_per_block - 3.
-     
-    uint32_t file_size = (uint32_t)file_size_long;
-    uint32_t data_per_block = sb.bytes_per_block - 3;
-    uint32_t blocks_needed =
-        (file_size + data_per_block - 1) / data_per_block;
-    if (blocks_needed == 0)
-        blocks_needed = 1;
+    int rc = 0;
+    uint32_t new_blocks = 0;
+    uint16_t next = 0xFFFF;
 
-    // Quick capacity check: ensure enough free blocks and a free dir entry
-    if (sb.available_blocks < blocks_needed ||
-        sb.available_direntries == 0) {
-        fprintf(stderr, "Not enough space in filesystem.\n");
-        fclose(in);
-        fclose(fp);
-        return 7;
+    for (uint32_t i = blocks_needed; i-- > 0; ) {
+        uint8_t *buffer = frames + (size_t)i * bpb;
+
+        uint32_t pos = i * data_per_block;
+        uint32_t chunk = file_size - pos;
+        if (chunk > data_per_block)
+            chunk = data_per_block;
+        fseek(in, pos, SEEK_SET);
+        size_t got = fread(buffer + 1, 1, chunk, in);
+        kern.frame(&kern, buffer, 1, got, &next);
+
+        uint64_t h = block_hash(buffer + 1, bpb - 1);
+
+        // Probe the table for blocks with the same hash and compare them
+        int match = -1;
+        for (uint32_t s = (uint32_t)h & idx.mask; idx.slots[s]; s = (s + 1) & idx.mask) {
+            uint16_t b = (uint16_t)(idx.slots[s] - 1);
+            if (idx.hashes[b] != h)
+                continue;
+
+            const uint8_t *have;
+            if (planned[b]) {
+                have = frames + (size_t)plan_pos[b] * bpb;
+            } else {
+                fseek(fp, block_offset(sb, b), SEEK_SET);
+                if (fread(candidate, bpb, 1, fp) != 1)
+                    continue;
+                have = candidate;
+            }
+            if (have[0] == 0x00 || have[0] >= QFS_MAX_REFS)
+                continue;
+            if (memcmp(have + 1, buffer + 1, bpb - 1) == 0) {
+                match = b;
+                break;
+            }
+        }
+
+        if (match >= 0) {
+            chain[i] = (uint16_t)match;
+            if (planned[match])
+                frames[(size_t)plan_pos[match] * bpb]++;
+        } else {
+            // No match: this position needs a block of its own
+            if (free_count == 0) {
+                fprintf(stderr, "Not enough free blocks.\n");
+                rc = 10;
+                break;
+            }
+            uint16_t found = free_list[--free_count];
+            chain[i] = found;
+            is_new[i] = 1;
+            planned[found] = 1;
+            plan_pos[found] = i;
+            index_insert(&idx, found, h);
+            new_blocks++;
+        }
+        next = chain[i];
     }
 
-    // Find a free directory entry (first empty filename)
-    int dir_index = -1;
-    fseek(fp, sizeof(superblock_t), SEEK_SET);
+    if (rc == 0) {
+        // New and newly shared blocks both change (see qfs_gen.h)
+        qfs_gen_mark_image(image, chain, blocks_needed);
+        uint32_t done = 0;
+        for (; done < blocks_needed; done++) {
+            uint16_t b = chain[done];
+            fseek(fp, block_offset(sb, b), SEEK_SET);
+            if (is_new[done]) {
+                if (fwrite(frames + (size_t)done * bpb, 1, bpb, fp) != bpb)
+                    break;
+            } else if (!planned[b]) {
+                // Shared with an existing file: one more reference
+                uint8_t busy;
+                if (fread(&busy, 1, 1, fp) != 1)
+                    break;
+                busy++;
+                fseek(fp, block_offset(sb, b), SEEK_SET);
+                if (fwrite(&busy, 1, 1, fp) != 1)
+                    break;
+            }
+        }
+        if (done < blocks_needed) {
+            fprintf(stderr, "Error writing block %u.\n", chain[done]);
+            rc = 11;
+        } else if (fflush(fp) != 0) {
+            fprintf(stderr, "Error writing file to disk image.\n");
+            rc = 11;
+        }
 
-    for (int i = 0; i < sb.total_direntries; i++) {
-        direntry_t d;
-        fread(&d, sizeof(direntry_t), 1, fp);
-        if (d.filename[0] == '\0') {
-            dir_index = i;
+        if (rc != 0) {
+            // Undo what was written so far, best effort, so the blocks
+            // are not left claimed by a file the directory never names
+            for (uint32_t i = 0; i < done; i++) {
+                uint16_t b = chain[i];
+                uint8_t busy = 0x00;
+                if (!is_new[i]) {
+                    if (planned[b])
+                        continue;
+                    fseek(fp, block_offset(sb, b), SEEK_SET);
+                    if (fread(&busy, 1, 1, fp) != 1 || busy == 0x00)
+                        continue;
+                    busy--;
+                }
+                fseek(fp, block_offset(sb, b), SEEK_SET);
+                fwrite(&busy, 1, 1, fp);
+            }
+            fflush(fp);
+        }
+    }
+
+    if (rc == 0) {
+        index_save(&idx, sb, image);
+
+        *starting_block = chain[0];
+        *blocks_used = new_blocks;
+
+#ifdef DEBUG
+        printf("Dedup: %u of %u blocks shared\n",
+               blocks_needed - new_blocks, blocks_needed);
+#endif
+    }
+
+    free(free_list);
+    free(chain);
+    free(frames);
+    free(is_new);
+    free(planned);
+    free(plan_pos);
+    free(candidate);
+    index_free(&idx);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Pipelined writer
+// ---------------------------------------------------------------------------
+
+#define PIPE_EXTENT_BLOCKS 64     // blocks framed per ring buffer
+#define PIPE_RING_SLOTS    4      // ring buffers between reader and writer
+
+typedef struct pipe_slot {
+    uint8_t  *buf;                // framed blocks, back to back
+    uint32_t  first;              // position in the file of the first block
+    uint32_t  count;              // number of framed blocks
+} pipe_slot_t;
+
+typedef struct pipeline {
+    int                 fd;       // image file
+    const superblock_t *sb;
+    const uint16_t     *blocks;   // allocated block numbers, in file order
+    pipe_slot_t         slot[PIPE_RING_SLOTS];
+    unsigned            head;     // oldest filled slot
+    unsigned            count;    // filled slots waiting for the writer
+    int                 done;     // reader has filled its last slot
+    int                 error;    // a write failed (at error_block), under lock
+    uint16_t            error_block;
+    pthread_mutex_t     lock;
+    pthread_cond_t      filled, drained;
+} pipeline_t;
+
+static void pipe_write_slot(pipeline_t *p, const pipe_slot_t *s) {
+    // Write the slot's blocks, one pwrite() per run of consecutive block
+    // numbers. Free blocks are handed out in ascending order, so a slot is
+    // usually a single extent. Nothing more is written after a failure.
+    uint32_t bpb = p->sb->bytes_per_block;
+    const uint16_t *blocks = p->blocks + s->first;
+
+    pthread_mutex_lock(&p->lock);
+    int failed = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    for (uint32_t i = 0; i < s->count && !failed; ) {
+        uint32_t j = i + 1;
+        while (j < s->count && blocks[j] == blocks[j - 1] + 1)
+            j++;
+
+        size_t len = (size_t)(j - i) * bpb;
+        if (qfs_io_full(p->fd, 1, s->buf + (size_t)i * bpb, len,
+                        block_offset(p->sb, blocks[i])) != (ssize_t)len) {
+            pthread_mutex_lock(&p->lock);
+            p->error = 1;
+            p->error_block = blocks[i];
+            pthread_mutex_unlock(&p->lock);
+            failed = 1;
+        }
+        i = j;
+    }
+}
+
+static void *pipe_writer(void *arg) {
+    pipeline_t *p = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->count == 0 && !p->done)
+            pthread_cond_wait(&p->filled, &p->lock);
+        if (p->count == 0) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        pipe_slot_t *s = &p->slot[p->head];
+        pthread_mutex_unlock(&p->lock);
+
+        pipe_write_slot(p, s);
+
+        pthread_mutex_lock(&p->lock);
+        p->head = (p->head + 1) % PIPE_RING_SLOTS;
+        p->count--;
+        pthread_cond_signal(&p->drained);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static size_t pipe_read_payloads(int in_fd, off_t offset, struct iovec *iov, int n) {
+    // Fill the iovecs from the input at 'offset', retrying short reads.
+    // Returns the number of bytes read; less than requested only at end of
+    // input. Explicit offsets keep this independent of the stdio stream's
+    // idea of the file position, which may be ahead of the descriptor's.
+    size_t total = 0;
+    while (n > 0) {
+        ssize_t r = preadv(in_fd, iov, n, offset + (off_t)total);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
             break;
+        total += r;
+        while (n > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + r;
+            iov->iov_len -= r;
         }
     }
+    return total;
+}
 
-    // If no free entry found, bail out
+static int write_pipelined(FILE *fp, const superblock_t *sb, FILE *in,
+                           uint32_t file_size, const uint16_t *blocks,
+                           uint32_t blocks_needed, uint16_t last_next) {
+    // Frame and write the file into the blocks allocated for it; the last
+    // block's next pointer is last_next. Returns 0 on success or the
+    // program's exit code on failure.
+    qfs_kernels_t kern;
+    qfs_kernels_init(&kern, sb);
+    uint32_t bpb = kern.bpb;
+    uint32_t data_per_block = kern.dpb;
+
+    qfs_pool_t pool;
+    if (qfs_pool_init(&pool, (size_t)bpb * PIPE_EXTENT_BLOCKS, PIPE_RING_SLOTS) != 0) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 9;
+    }
+
+    pipeline_t p;
+    memset(&p, 0, sizeof(p));
+    fflush(fp);
+    p.fd = fileno(fp);
+    p.sb = sb;
+    p.blocks = blocks;
+    for (unsigned k = 0; k < PIPE_RING_SLOTS; k++)
+        p.slot[k].buf = qfs_pool_get(&pool);
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.filled, NULL);
+    pthread_cond_init(&p.drained, NULL);
+
+    // Without a writer thread each slot is written as soon as it is framed
+    pthread_t writer;
+    int threaded = pthread_create(&writer, NULL, pipe_writer, &p) == 0;
+
+    int in_fd = fileno(in);
+    unsigned tail = 0;
+    uint32_t remaining = file_size;
+
+    for (uint32_t i = 0; i < blocks_needed; ) {
+        // Stop reading once a write has failed
+        pthread_mutex_lock(&p.lock);
+        while (p.count == PIPE_RING_SLOTS && !p.error)
+            pthread_cond_wait(&p.drained, &p.lock);
+        int failed = p.error;
+        pthread_mutex_unlock(&p.lock);
+        if (failed)
+            break;
+
+        pipe_slot_t *s = &p.slot[tail];
+        uint32_t n = blocks_needed - i;
+        if (n > PIPE_EXTENT_BLOCKS)
+            n = PIPE_EXTENT_BLOCKS;
+        s->first = i;
+        s->count = n;
+
+        // Read the input straight into each frame's payload area
+        struct iovec iov[PIPE_EXTENT_BLOCKS];
+        uint32_t want[PIPE_EXTENT_BLOCKS];
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t offset = k * data_per_block;
+            uint32_t left = remaining > offset ? remaining - offset : 0;
+            want[k] = left > data_per_block ? data_per_block : left;
+            iov[k].iov_base = s->buf + (size_t)k * bpb + 1;
+            iov[k].iov_len = want[k];
+        }
+        size_t got = pipe_read_payloads(in_fd, (off_t)(file_size - remaining), iov, n);
+
+        // Frame the blocks in one pass. Buffers are reused, so only the
+        // unused part of a short final payload needs clearing.
+        uint16_t next[PIPE_EXTENT_BLOCKS];
+        for (uint32_t k = 0; k < n; k++) {
+            next[k] = (i + k + 1 < blocks_needed) ? blocks[i + k + 1] : last_next;
+            remaining -= want[k];
+        }
+        kern.frame(&kern, s->buf, n, got, next);
+
+        if (!threaded) {
+            pipe_write_slot(&p, s);
+        } else {
+            pthread_mutex_lock(&p.lock);
+            p.count++;
+            pthread_cond_signal(&p.filled);
+            pthread_mutex_unlock(&p.lock);
+        }
+        tail = (tail + 1) % PIPE_RING_SLOTS;
+        i += n;
+    }
+
+    if (threaded) {
+        pthread_mutex_lock(&p.lock);
+        p.done = 1;
+        pthread_cond_signal(&p.filled);
+        pthread_mutex_unlock(&p.lock);
+        pthread_join(writer, NULL);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    int failed = p.error;
+    uint16_t failed_block = p.error_block;
+    pthread_mutex_unlock(&p.lock);
+
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.filled);
+    pthread_cond_destroy(&p.drained);
+    qfs_pool_destroy(&pool);
+
+    if (failed) {
+        fprintf(stderr, "Error writing block %u.\n", failed_block);
+        return 11;
+    }
+    return 0;
+}
+
+static int write_via_daemon(const char *image, const char *path, const char *name) {
+    // Returns the exit code, or -1 if there is no daemon serving the image.
+    // Once the daemon has been found, every failure is final: a write may
+    // already have happened.
+    if (!getenv(QFSD_SOCKET_ENV))
+        return -1;
+
+    // Find out first whether the daemon is going to take the file, before
+    // any input is consumed
+    void *reply;
+    uint32_t reply_len;
+    int status = qfsd_call(image, QFSD_OP_STAT, "", NULL, 0, &reply, &reply_len);
+    free(reply);
+    if (status == QFSD_NODAEMON || status == QFSD_NOIMAGE)
+        return -1;
+    if (status != QFSD_OK) {
+        if (status == QFSD_FAILED)
+            qfsd_perror(image);
+        else
+            fprintf(stderr, "Error writing file to disk image.\n");
+        return 11;
+    }
+
+    // The input is sent in pieces as it is read; standard input until it
+    // ends, a local file for the size it has now
+    int stream = strcmp(path, "-") == 0;
+    int in = STDIN_FILENO;
+    uint64_t size = QFSD_TO_EOF;
+    if (!stream) {
+        struct stat st;
+        in = open(path, O_RDONLY);
+        if (in < 0) {
+            perror("fopen(local file)");
+            return 5;
+        }
+        if (fstat(in, &st) != 0) {
+            fprintf(stderr, "Unable to determine file size.\n");
+            close(in);
+            return 6;
+        }
+        size = (uint64_t)st.st_size;
+    }
+
+    int input_error;
+    status = qfsd_call_fd(image, QFSD_OP_WRITE, name, in, size, &input_error,
+                          &reply, &reply_len);
+    free(reply);
+    if (!stream)
+        close(in);
+    if (input_error) {
+        fprintf(stderr, stream ? "Error reading standard input.\n"
+                               : "Error reading local file.\n");
+        return 6;
+    }
+
+    switch (status) {
+    case QFSD_OK:
+        printf("File \"%.22s\" written to disk image successfully.\n", name);
+        return 0;
+    case QFSD_NOSPACE:
+        fprintf(stderr, "Not enough space in filesystem.\n");
+        return 7;
+    case QFSD_NOMEM:
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 9;
+    case QFSD_IO:
+        fprintf(stderr, "Error writing file to disk image.\n");
+        return 11;
+    case QFSD_PROTO:
+        fprintf(stderr, "Invalid file name.\n");
+        return 1;
+    case QFSD_FAILED:
+        qfsd_perror(image);
+        return 11;
+    default:
+        fprintf(stderr, "Error writing file to disk image.\n");
+        return 11;
+    }
+}
+
+static int write_stream(FILE *fp, superblock_t *sb, const char *image, const char *name) {
+    // Store standard input as 'name'. Returns the program's exit code.
+    if (sb->available_blocks == 0 || sb->available_direntries == 0) {
+        fprintf(stderr, "Not enough space in filesystem.\n");
+        return 7;
+    }
+    int dir_index = find_free_direntries(fp, sb, 1);
     if (dir_index < 0) {
         fprintf(stderr, "No free directory entry found.\n");
-        fclose(in);
-        fclose(fp);
         return 8;
     }
 
-    // Find free blocks by scanning each block's busy byte
-    // The first byte of a block is treated as a busy flag: 0x00 = free
-    uint16_t *blocks = malloc(sizeof(uint16_t) * blocks_needed);
-    if (!blocks) {
+    qfs_alloc_t alloc;
+    if (qfs_alloc_init(&alloc, fileno(fp), sb) != 0) {
         fprintf(stderr, "Memory allocation failed.\n");
-        fclose(in);
-        fclose(fp);
         return 9;
     }
+    qfs_gen_t gen;
+    qfs_gen_open(&gen, image);
+    alloc.gen = &gen;
 
-    uint32_t found = 0;
-    for (uint16_t b = 0; b < sb.total_blocks && found < blocks_needed; b++) {
-        uint8_t busy;
-        // Read busy marker (first byte of block)
-        fseek(fp, block_offset(&sb, b), SEEK_SET);
-        fread(&busy, 1, 1, fp);
-        if (busy == 0x00)
-            blocks[found++] = b;
-    }
-
-    if (found < blocks_needed) {
+    fflush(fp);
+    uint16_t starting_block = 0xFFFF;
+    uint32_t blocks_used = 0, file_size = 0;
+    int rc = qfs_stream_write(&alloc, STDIN_FILENO, QFS_STREAM_TO_EOF,
+                              &starting_block, &blocks_used, &file_size);
+    qfs_gen_close(&gen);
+    qfs_alloc_destroy(&alloc);
+    switch (rc) {
+    case 0:
+        break;
+    case QFS_STREAM_ENOSPC:
         fprintf(stderr, "Not enough free blocks.\n");
-        free(blocks);
-        fclose(in);
-        fclose(fp);
         return 10;
+    case QFS_STREAM_ENOMEM:
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 9;
+    case QFS_STREAM_EINPUT:
+        fprintf(stderr, "Error reading standard input.\n");
+        return 6;
+    default:
+        fprintf(stderr, "Error writing file to disk image.\n");
+        return 11;
     }
 
-    // Save the starting block for the directory entry
-    uint16_t starting_block = blocks[0];
+    // Now that the size is known, write the directory entry
+    qfs_trace_size(file_size);
+    direntry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.filename, name, sizeof(entry.filename) - 1);
+    entry.starting_block = starting_block;
+    entry.file_size = file_size;
 
-    // Write the file across allocated blocks.
-    // Block layout used by QFS in this implementation:
-    //  [0]    = busy marker (0x01 for in-use)
-    //  [1..N] = payload data (up to data_per_block bytes)
-    //  [last-2,last-1] = next-block pointer (little-endian uint16)
-    //  A next pointer of 0xFFFF denotes end-of-file.
-    uint8_t *buffer = malloc(sb.bytes_per_block);
-    uint32_t remaining = file_size;
+    fseek(fp,
+          sizeof(superblock_t) +
+          dir_index * sizeof(direntry_t),
+          SEEK_SET);
+    fwrite(&entry, sizeof(direntry_t), 1, fp);
+
+    sb->available_blocks -= blocks_used;
+    sb->available_direntries--;
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(sb, sizeof(superblock_t), 1, fp);
+
+    printf("File \"%s\" written to disk image successfully.\n", entry.filename);
+    return 0;
+}
 
-    for (uint32_t i = 0; i < blocks_needed; i++) {
-        uint16_t cur = blocks[i];
-        uint16_t next = (i + 1 < blocks_needed) ? blocks[i + 1] : 0xFFFF;
+static int write_inline(FILE *fp, FILE *in, uint32_t file_size,
+                        int dir_index, uint32_t inline_slots) {
+    // Store a small file in the continuation records after its directory
+    // entry. Returns 0 or the program's exit code; on a failed write the
+    // records are cleared again, best effort, so they read as free.
+    uint8_t data[QFS_INLINE_MAX];
+    if (fread(data, 1, file_size, in) != file_size) {
+        fprintf(stderr, "Error reading local file.\n");
+        return 6;
+    }
 
-        memset(buffer, 0, sb.bytes_per_block);
-        // mark block as busy
-        buffer[0] = 0x01;
+    long first = sizeof(superblock_t) + (dir_index + 1) * sizeof(direntry_t);
+    fseek(fp, first, SEEK_SET);
+    uint32_t k = 0;
+    for (; k < inline_slots; k++) {
+        uint8_t record[sizeof(direntry_t)];
+        uint32_t offset = k * QFS_INLINE_PER_SLOT;
+        uint32_t n = file_size - offset;
+        if (n > QFS_INLINE_PER_SLOT)
+            n = QFS_INLINE_PER_SLOT;
+        memset(record, 0, sizeof(record));
+        record[0] = QFS_DIRENT_CONT;
+        memcpy(record + 1, data + offset, n);
+        if (fwrite(record, sizeof(record), 1, fp) != 1)
+            break;
+    }
+    if (k == inline_slots && fflush(fp) == 0)
+        return 0;
 
-        // copy up to data_per_block bytes from input file
-        uint32_t chunk =
-            (remaining > data_per_block) ? data_per_block : remaining;
-        fread(buffer + 1, 1, chunk, in);
+    fprintf(stderr, "Error writing file to disk image.\n");
+    direntry_t empty;
+    memset(&empty, 0, sizeof(empty));
+    fseek(fp, first, SEEK_SET);
+    for (uint32_t i = 0; i < inline_slots; i++)
+        fwrite(&empty, sizeof(empty), 1, fp);
+    fflush(fp);
+    return 11;
+}
 
-        // write next pointer in little-endian order
-        buffer[sb.bytes_per_block - 2] = next & 0xFF;
-        buffer[sb.bytes_per_block - 1] = (next >> 8) & 0xFF;
+static int place_tail(FILE *fp, superblock_t *sb, FILE *in, off_t tail_offset,
+                      uint32_t tail_len, int dir_index, uint8_t *tail_buf,
+                      uint16_t *tail_block) {
+    // Build in 'tail_buf' the tail block that takes the file's last
+    // 'tail_len' bytes: the current tail block if it still has room,
+    // otherwise a fresh one, which leaves *tail_block at 0xFFFF for the
+    // caller to allocate with the rest. Returns 0 or the exit code.
+    uint8_t *tail_data = malloc(tail_len);
+    if (!tail_data) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 9;
+    }
 
-        fseek(fp, block_offset(&sb, cur), SEEK_SET);
-        fwrite(buffer, 1, sb.bytes_per_block, fp);
+    // pread leaves the input offset at the start for the pipeline
+    if (qfs_io_full(fileno(in), 0, tail_data, tail_len, tail_offset) != (ssize_t)tail_len) {
+        fprintf(stderr, "Error reading local file.\n");
+        free(tail_data);
+        return 6;
+    }
 
-        remaining -= chunk;
+    uint32_t bpb = sb->bytes_per_block;
+    *tail_block = 0xFFFF;
+    if (sb->tail_block < sb->total_blocks) {
+        fseek(fp, block_offset(sb, sb->tail_block), SEEK_SET);
+        if (fread(tail_buf, 1, bpb, fp) == bpb && tail_buf[0] != 0x00 &&
+            qfs_tail_rebuild(sb, tail_buf, -1, (uint8_t)dir_index,
+                             tail_data, (uint16_t)tail_len) == 0)
+            *tail_block = sb->tail_block;
+    }
+    if (*tail_block == 0xFFFF) {
+        qfs_tail_init(sb, tail_buf);
+        qfs_tail_rebuild(sb, tail_buf, -1, (uint8_t)dir_index,
+                         tail_data, (uint16_t)tail_len);
+    }
+    free(tail_data);
+    return 0;
+}
+
+static int write_blocks(FILE *fp, superblock_t *sb, FILE *in, const char *image,
+                        qfs_holes_t *holes, uint32_t file_size,
+                        uint32_t blocks_needed, uint32_t tail_len, int dir_index,
+                        uint16_t *starting_block, uint32_t *blocks_used) {
+    // Write the file into free blocks, with a packed tail of 'tail_len'
+    // bytes when it is non-zero. Returns 0 or the program's exit code.
+    uint32_t bpb = sb->bytes_per_block;
+    uint8_t *tail_buf = NULL;
+    uint16_t *blocks = NULL;
+    uint16_t tail_block = 0xFFFF;
+    uint32_t new_tail = 0;
+    int rc = 0;
+
+    if (tail_len) {
+        tail_buf = malloc(bpb);
+        if (!tail_buf) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            rc = 9;
+        } else {
+            rc = place_tail(fp, sb, in,
+                            (off_t)blocks_needed * qfs_data_per_block(sb),
+                            tail_len, dir_index, tail_buf, &tail_block);
+            new_tail = tail_block == 0xFFFF;
+        }
+    }
+
+    // Find free blocks by scanning each block's busy byte
+    // The first byte of a block is treated as a busy flag: 0x00 = free
+    uint32_t to_allocate = blocks_needed + new_tail;
+    if (rc == 0) {
+        blocks = malloc(sizeof(uint16_t) * (to_allocate + 1));
+        if (!blocks) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            rc = 9;
+        }
+    }
+    if (rc == 0) {
+        uint32_t found = 0;
+        for (uint16_t b = 0; b < sb->total_blocks && found < to_allocate; b++) {
+            if (block_is_free(fp, sb, holes, b))
+                blocks[found++] = b;
+        }
+        if (found < to_allocate) {
+            fprintf(stderr, "Not enough free blocks.\n");
+            rc = 10;
+        }
+    }
+
+    if (rc == 0) {
+        if (new_tail)
+            tail_block = blocks[blocks_needed];
+
+        // Save the starting block for the directory entry
+        *starting_block = blocks_needed ? blocks[0] : tail_block;
+
+        // Stamp the blocks about to change for snapshots (see qfs_gen.h),
+        // including an existing tail block that takes this file's tail
+        uint32_t touched = to_allocate;
+        if (tail_buf && !new_tail)
+            blocks[touched++] = tail_block;
+        qfs_gen_mark_image(image, blocks, touched);
+
+        // Write the file across allocated blocks.
+        // Block layout used by QFS in this implementation:
+        //  [0]    = busy marker (0x01 for in-use)
+        //  [1..N] = payload data (up to data_per_block bytes)
+        //  [last-6..last-3] = CRC32C, on checksummed images only
+        //  [last-2,last-1] = next-block pointer (little-endian uint16)
+        //  A next pointer of 0xFFFF denotes end-of-file; a packed file's
+        //  last full block points at its tail block instead.
+        rc = write_pipelined(fp, sb, in, file_size - tail_len, blocks,
+                             blocks_needed, tail_block);
+        if (rc == 0 && tail_buf) {
+            fseek(fp, block_offset(sb, tail_block), SEEK_SET);
+            if (fwrite(tail_buf, 1, bpb, fp) != bpb) {
+                fprintf(stderr, "Error writing block %u.\n", tail_block);
+                rc = 11;
+            }
+        }
     }
 
-    free(buffer);
+    if (rc == 0) {
+        if (tail_buf)
+            sb->tail_block = tail_block;
+        *blocks_used = to_allocate;
+    }
     free(blocks);
-    fclose(in);
+    free(tail_buf);
+    return rc;
+}
+
+static int write_local(FILE *fp, superblock_t *sb, FILE *in,
+                       const char *image, const char *name) {
+    // Store the local file 'in' as 'name'. Returns the program's exit code.
+    fseek(in, 0, SEEK_END);
+    long file_size_long = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    if (file_size_long < 0) {
+        fprintf(stderr, "Unable to determine file size.\n");
+        return 6;
+    }
+
+    // Convert size and compute how many blocks are required.
+    // Each QFS block reserves 1 byte for a busy marker and
+    // 2 bytes for the next-block pointer (little-endian),
+    // so usable payload per block = bytes_per_block - 3
+    // (4 bytes less again when blocks carry a CRC32C).
+     
+    uint32_t file_size = (uint32_t)file_size_long;
+    qfs_trace_size(file_size);
+    uint32_t data_per_block = qfs_data_per_block(sb);
+    uint32_t blocks_needed =
+        (file_size + data_per_block - 1) / data_per_block;
+    if (blocks_needed == 0)
+        blocks_needed = 1;
+
+    // On packed images small files go into the directory and short tails
+    // into a shared tail block, so they need fewer (or no) blocks
+    int dedup = (sb->features & QFS_FEAT_DEDUP) != 0;
+    int pack = (sb->features & QFS_FEAT_PACK) != 0;
+    uint32_t inline_slots = 0;
+    int inline_file = pack && file_size <= QFS_INLINE_MAX;
+    if (inline_file)
+        inline_slots = qfs_inline_slots(file_size);
+
+    // Find a free directory entry (first empty filename), followed by the
+    // continuation records of an inline file. Without room for those the
+    // file is stored in blocks instead.
+    int dir_index = -1;
+    if (inline_file && sb->available_direntries > inline_slots)
+        dir_index = find_free_direntries(fp, sb, 1 + inline_slots);
+    if (dir_index < 0) {
+        inline_file = 0;
+        inline_slots = 0;
+        dir_index = find_free_direntries(fp, sb, 1);
+    }
+
+    uint32_t tail_len = 0;
+    if (inline_file) {
+        blocks_needed = 0;
+    } else if (pack && !dedup &&
+               qfs_tail_packable(sb, file_size % data_per_block)) {
+        tail_len = file_size % data_per_block;
+        blocks_needed = file_size / data_per_block;   // full blocks only
+    }
+
+    // Quick capacity check: ensure enough free blocks and a free dir entry.
+    // With deduplication the number of new blocks is only known once the
+    // file has been matched against the index, so that check happens later.
+    if ((!dedup && sb->available_blocks < blocks_needed) ||
+        sb->available_direntries == 0) {
+        fprintf(stderr, "Not enough space in filesystem.\n");
+        return 7;
+    }
+
+    // If no free entry found, bail out
+    if (dir_index < 0) {
+        fprintf(stderr, "No free directory entry found.\n");
+        return 8;
+    }
+
+    uint16_t starting_block = 0xFFFF;
+    uint32_t blocks_used = blocks_needed;
+    uint8_t permissions = 0;
+
+    // Separate descriptor for SEEK_DATA/SEEK_HOLE queries, so that moving
+    // its offset cannot confuse the stdio stream
+    int hole_fd = open(image, O_RDONLY);
+    qfs_holes_t holes_state;
+    qfs_holes_t *holes = NULL;
+    if (hole_fd >= 0) {
+        qfs_holes_init(&holes_state, hole_fd);
+        holes = &holes_state;
+    }
+
+    int rc;
+    if (inline_file) {
+        rc = write_inline(fp, in, file_size, dir_index, inline_slots);
+        permissions |= QFS_PERM_INLINE;
+    } else if (dedup) {
+        rc = write_dedup(fp, sb, in, file_size, blocks_needed, image,
+                         holes, &starting_block, &blocks_used);
+    } else {
+        rc = write_blocks(fp, sb, in, image, holes, file_size, blocks_needed,
+                          tail_len, dir_index, &starting_block, &blocks_used);
+        if (tail_len)
+            permissions |= QFS_PERM_TAIL;
+    }
+    if (hole_fd >= 0)
+        close(hole_fd);
+    if (rc != 0)
+        return rc;
 
     // Populate and write a directory entry for the file
     direntry_t entry;
     memset(&entry, 0, sizeof(entry));
 
-    strncpy(entry.filename, basename_simple(argv[2]),
-            sizeof(entry.filename) - 1);
+    strncpy(entry.filename, name, sizeof(entry.filename) - 1);
     entry.starting_block = starting_block;
     entry.file_size = file_size;
+    entry.permissions = permissions;
 
     fseek(fp,
           sizeof(superblock_t) +
@@ -217,14 +1132,77 @@ int main(int argc, char *argv[]) {
     fwrite(&entry, sizeof(direntry_t), 1, fp);
 
     // Update superblock metadata: reduce free counts
-    sb.available_blocks -= blocks_needed;
-    sb.available_direntries--;
+    sb->available_blocks -= blocks_used;
+    sb->available_direntries -= 1 + inline_slots;
 
     fseek(fp, 0, SEEK_SET);
-    fwrite(&sb, sizeof(superblock_t), 1, fp);
-
-    fclose(fp);
+    fwrite(sb, sizeof(superblock_t), 1, fp);
 
     printf("File \"%s\" written to disk image successfully.\n", entry.filename);
     return 0;
 }
+
+static int run(int argc, char *argv[]) {
+
+    int stream = argc == 4 && strcmp(argv[2], "-") == 0;
+    if (argc != 3 && !stream) {
+        fprintf(stderr, "Usage: %s <disk image file> <file to add>\n"
+                        "       %s <disk image file> - <name>\n", argv[0], argv[0]);
+        return 1;
+    }
+    const char *name = basename_simple(stream ? argv[3] : argv[2]);
+
+    int forwarded = write_via_daemon(argv[1], argv[2], name);
+    if (forwarded >= 0) {
+        qfs_trace_skip();
+        return forwarded;
+    }
+
+    FILE *fp = fopen(argv[1], "rb+");
+    if (!fp) {
+        perror("fopen");
+        return 2;
+    }
+    if (qfsd_lock_image(fileno(fp), argv[1], 1) != 0) {
+        fclose(fp);
+        return 2;
+    }
+
+#ifdef DEBUG
+    printf("Opened disk image: %s\n", argv[1]);
+#endif
+
+    // Read and validate superblock
+    superblock_t sb;
+    int rc;
+    if (fread(&sb, sizeof(superblock_t), 1, fp) != 1) {
+        fprintf(stderr, "Error reading superblock.\n");
+        rc = 3;
+    } else if (sb.fs_type != 0x51) {
+        fprintf(stderr, "Not a valid QFS filesystem.\n");
+        rc = 4;
+    } else if (stream) {
+        rc = write_stream(fp, &sb, argv[1], name);
+    } else {
+        // Open local file; write_local sizes and stores it
+        FILE *in = fopen(argv[2], "rb");
+        if (!in) {
+            perror("fopen(local file)");
+            rc = 5;
+        } else {
+            rc = write_local(fp, &sb, in, argv[1], name);
+            fclose(in);
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int stream = argc == 4 && strcmp(argv[2], "-") == 0;
+    qfs_trace_begin(QFS_TRACE_WRITE,
+                    argc >= 3 ? basename_simple(stream ? argv[3] : argv[2]) : "");
+    int rc = run(argc, argv);
+    qfs_trace_end(rc);
+    return rc;
+}